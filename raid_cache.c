@@ -11,28 +11,132 @@
 // Includes
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/time.h>
+#include <string.h>
+#include <pthread.h>
 
 // Project includes
 #include <cmpsc311_log.h>
 #include <cmpsc311_util.h>
 #include <raid_cache.h>
 
-// Structure for an entry in the cache
+// Defines
+#define CACHE_ARENA_ALIGNMENT	4096	// Alignment of the block arena
+#define TWO_QUEUE_IN_SHARE	4	// 2Q keeps blocks used once in 1/4 of the cache
+#define TWO_QUEUE_OUT_SHARE	2	// and remembers as many evictions as 1/2 of it
+
+// Structure for an entry in the cache. Each entry owns one fixed slot of the
+// block arena and holds exactly one tag block, whichever RAID blocks store it.
+// A dirty entry has not been written to RAID yet and remembers where its
+// primary and mirror copies live.
+// Entries are chained in a hash bucket by (tagline, block) and linked in one of
+// the lists of the replacement policy, most recently used first. A pinned
+// entry is lent out to readers and is never evicted or changed; if its block
+// is rewritten or dropped meanwhile it is detached from the index and freed on
+// its last release. Ghost entries have no block and only remember the address
+// of a block the policy evicted recently.
+typedef struct CacheEntry {
+	TagLineNumber tag;
+	TagLineBlockNumber bnum;
+	int dirty;
+	int pins;
+	int detached;
+	int list;
+	int referenced;
+	RAIDDiskID disk, diskCopy;
+	RAIDBlockID blockID, blockIDCopy;
+	int *buffer;
+	struct CacheEntry *hashNext;
+	struct CacheEntry *prev, *next;
+} CacheEntry;
+
+// Lists of the replacement policies: LRU and CLOCK keep every block in the
+// first one, 2Q uses them as A1in, Am and A1out and ARC as T1, T2, B1 and B2
+#define CACHE_RECENT		0	// Blocks used once since they were cached
+#define CACHE_FREQUENT		1	// Blocks used again since they were cached
+#define CACHE_RECENT_GHOSTS	2	// Addresses evicted from the recent list
+#define CACHE_FREQUENT_GHOSTS	3	// Addresses evicted from the frequent list
+#define CACHE_LISTS		4
+
+// Structure for a list of entries, most recently used first
+typedef struct {
+	CacheEntry *head, *tail;
+	int size;
+} CacheList;
+
+// Structure for a replacement policy. hit is called when a cached block is
+// used, admit when a block is cached (ghost is its ghost entry or NULL),
+// victim picks an unpinned block to evict for the block of ghost without
+// evicting it, and remove takes an entry out of the policy, remembering its
+// address when it is evicted.
+typedef struct {
+	const char *name;
+	void (*hit)(CacheEntry *entry);
+	void (*admit)(CacheEntry *entry, CacheEntry *ghost);
+	CacheEntry *(*victim)(CacheEntry *ghost);
+	void (*remove)(CacheEntry *entry, int evicted);
+} CachePolicyOps;
+
+// Structure for one block of a write-back flush
 typedef struct {
-	time_t clkTick;
 	RAIDDiskID disk;
 	RAIDBlockID blockID;
 	int *buffer;
-} CacheEntry;
+} FlushBlock;
 
 // Global variables
 
-CacheEntry **cache, *leastRecent;
-int initialized, maxSize;
+CacheEntry *cache, **hashTable, *freeEntries;
+CacheEntry *ghosts, **ghostTable, *freeGhosts;
+CacheList lists[CACHE_LISTS];
+const CachePolicyOps *policy;
+char *arena;
+int initialized, maxItems, writeBack, pinnedEntries;
+int targetRecent;
+unsigned int hashMask;
+
+// Serializes every access from the driver's threads. Callers of the public
+// functions never hold it; the internal functions expect it to be held.
+pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
 
 // Fuction prototype
-void calc_least_recent();
+unsigned int hash_raid_cache(TagLineNumber tag, TagLineBlockNumber bnum);
+void unhash_raid_cache(CacheEntry **table, CacheEntry *entry);
+void unlink_raid_cache(CacheEntry *entry);
+CacheEntry *find_raid_cache(TagLineNumber tag, TagLineBlockNumber bnum);
+CacheEntry *find_ghost_raid_cache(TagLineNumber tag, TagLineBlockNumber bnum);
+void remember_raid_cache(CacheEntry *entry, int list);
+void forget_raid_cache(CacheEntry *ghost);
+void push_raid_cache(CacheEntry *entry, int list);
+void pull_raid_cache(CacheEntry *entry);
+CacheEntry *oldest_raid_cache(int list);
+CacheEntry *claim_raid_cache(CacheEntry *ghost);
+CacheEntry *store_raid_cache(TagLineNumber tag, TagLineBlockNumber bnum, void *buf);
+int write_back_raid_cache(void);
+int compare_flush_blocks(const void *a, const void *b);
+int write_flush_blocks(FlushBlock *blocks, int count);
+void hit_lru_raid_cache(CacheEntry *entry);
+void admit_lru_raid_cache(CacheEntry *entry, CacheEntry *ghost);
+CacheEntry *victim_lru_raid_cache(CacheEntry *ghost);
+void remove_lru_raid_cache(CacheEntry *entry, int evicted);
+void hit_clock_raid_cache(CacheEntry *entry);
+CacheEntry *victim_clock_raid_cache(CacheEntry *ghost);
+void hit_two_queue_raid_cache(CacheEntry *entry);
+void admit_two_queue_raid_cache(CacheEntry *entry, CacheEntry *ghost);
+CacheEntry *victim_two_queue_raid_cache(CacheEntry *ghost);
+void remove_two_queue_raid_cache(CacheEntry *entry, int evicted);
+void hit_arc_raid_cache(CacheEntry *entry);
+void admit_arc_raid_cache(CacheEntry *entry, CacheEntry *ghost);
+CacheEntry *victim_arc_raid_cache(CacheEntry *ghost);
+void remove_arc_raid_cache(CacheEntry *entry, int evicted);
+
+// Replacement policies, in the order of CACHE_POLICY_TYPES
+const CachePolicyOps cachePolicies[CACHE_POLICY_MAXVAL] = {
+	{ "LRU", hit_lru_raid_cache, admit_lru_raid_cache, victim_lru_raid_cache, remove_lru_raid_cache },
+	{ "CLOCK", hit_clock_raid_cache, admit_lru_raid_cache, victim_clock_raid_cache, remove_lru_raid_cache },
+	{ "2Q", hit_two_queue_raid_cache, admit_two_queue_raid_cache, victim_two_queue_raid_cache,
+		remove_two_queue_raid_cache },
+	{ "ARC", hit_arc_raid_cache, admit_arc_raid_cache, victim_arc_raid_cache, remove_arc_raid_cache },
+};
 
 //
 // TAGLINE Cache interface
@@ -40,24 +144,74 @@ void calc_least_recent();
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : init_raid_cache
-// Description  : Initialize the cache and note maximum blocks
+// Description  : Initialize the cache and note maximum blocks. All of the
+//                block storage is allocated here as one aligned arena of
+//                RAID_BLOCK_SIZE slots, one per entry, along with as many
+//                ghost entries for the policies that remember evicted blocks.
 //
-// Inputs       : max_items - the maximum number of items your cache can hold
+// Inputs       : max_items - the maximum number of blocks your cache can hold
+//                replacement - the replacement policy
 // Outputs      : 0 if successful, -1 if failure
 
-int init_raid_cache(uint32_t max_items) {
+int init_raid_cache(uint32_t max_items, CACHE_POLICY_TYPES replacement) {
+
+	// Declares variables
+	unsigned int buckets;
+	uint32_t i;
+
+	if (max_items == 0) {
+		logMessage(LOG_ERROR_LEVEL, "The cache must hold at least one block");
+		return (-1);
+	}
+	if (replacement >= CACHE_POLICY_MAXVAL) {
+		logMessage(LOG_ERROR_LEVEL, "The cache replacement policy is unknown");
+		return (-1);
+	}
 
-	// Initializes cache
-	cache = (CacheEntry **) calloc(TAGLINE_CACHE_SIZE, sizeof(CacheEntry));
+	// Initializes cache entries
+	cache = (CacheEntry *) calloc(max_items, sizeof(CacheEntry));
 	
 	if (cache == NULL) {
 		logMessage(LOG_ERROR_LEVEL, "Memory is not allocated successfully");
 		return (-1);
 	}
 
+	// Initializes the block arena
+	if (posix_memalign((void **) &arena, CACHE_ARENA_ALIGNMENT, (size_t) max_items * RAID_BLOCK_SIZE) != 0) {
+		logMessage(LOG_ERROR_LEVEL, "Memory is not allocated successfully");
+		free(cache);
+		cache = NULL;
+		return (-1);
+	}
+
+	// Initializes the hash index with at least two buckets per entry
+	for (buckets = 1; buckets < max_items * 2; buckets <<= 1);
+	hashTable = (CacheEntry **) calloc(buckets, sizeof(CacheEntry *));
+	ghostTable = (CacheEntry **) calloc(buckets, sizeof(CacheEntry *));
+	ghosts = (CacheEntry *) calloc(max_items, sizeof(CacheEntry));
+
+	if (hashTable == NULL || ghostTable == NULL || ghosts == NULL) {
+		logMessage(LOG_ERROR_LEVEL, "Memory is not allocated successfully");
+		return (-1);
+	}
+	hashMask = buckets - 1;
+
+	// Chains every ghost entry on the free list
+	freeGhosts = NULL;
+	for (i = max_items; i > 0; i--) {
+		ghosts[i - 1].next = freeGhosts;
+		freeGhosts = &ghosts[i - 1];
+	}
+
 	// Initializes cache information
 	initialized = 0;
-	maxSize = max_items * 1024;
+	maxItems = max_items;
+	writeBack = 0;
+	freeEntries = NULL;
+	pinnedEntries = 0;
+	memset(lists, 0, sizeof(lists));
+	policy = &cachePolicies[replacement];
+	targetRecent = 0;
 	
 	// Return successfully
 	return(0);
@@ -73,105 +227,178 @@ int init_raid_cache(uint32_t max_items) {
 
 int close_raid_cache(void) {
 
-	// Declares variables
-	int i;
-
-	// Frees buffer in cache entrires and
-	// the cache entries themselves
-	i = 0;
-	while (i < initialized) {
-		free(cache[i]->buffer);
-		cache[i]->buffer = NULL;
-		free(cache[i]);
-		cache[i] = NULL;
-		i++;
+	// Writes back any dirty blocks
+	if (flush_raid_cache() == -1) {
+		logMessage(LOG_ERROR_LEVEL, "Dirty blocks could not be written back");
 	}
-	
-	// Frees the cache
+
+	// Frees the cache entries, the block arena and the index
 	free(cache);
 	cache = NULL;
 
+	free(arena);
+	arena = NULL;
+
+	free(hashTable);
+	hashTable = NULL;
+
+	free(ghosts);
+	ghosts = NULL;
+
+	free(ghostTable);
+	ghostTable = NULL;
+	freeGhosts = NULL;
+	memset(lists, 0, sizeof(lists));
+
 	// Return successfully
 	return(0);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : set_raid_cache_write_back
+// Description  : Turns write-back mode on or off. Turning it off writes back
+//                every dirty block first.
+//
+// Inputs       : enabled - non-zero to hold written blocks dirty in the cache
+// Outputs      : 0 if successful, -1 if failure
+
+int set_raid_cache_write_back(int enabled) {
+
+	// Writes back everything that is dirty when leaving write-back mode
+	if (!enabled && flush_raid_cache() == -1) {
+		return (-1);
+	}
+
+	writeBack = enabled;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : raid_cache_write_back
+// Description  : Reports whether the cache is in write-back mode
+//
+// Inputs       : none
+// Outputs      : non-zero if write-back mode is on
+
+int raid_cache_write_back(void) {
+	return (writeBack);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : raid_cache_policy
+// Description  : Reports the replacement policy the cache was initialized with
+//
+// Inputs       : none
+// Outputs      : the name of the policy
+
+const char *raid_cache_policy(void) {
+	return (policy != NULL ? policy->name : "none");
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : put_raid_cache
-// Description  : Put an object into the block cache
+// Description  : Put an object into the block cache. The block is taken to
+//                match what RAID holds, so an existing entry is no longer dirty.
 //
-// Inputs       : dsk - this is the disk number of the block to cache
-//                blk - this is the block number of the block to cache
+// Inputs       : tag - this is the tagline of the block to cache
+//                bnum - this is the tagline block number of the block to cache
 //                buf - the buffer to insert into the cache
 // Outputs      : 0 if successful, -1 if failure
 
-int put_raid_cache(RAIDDiskID dsk, RAIDBlockID blk, void *buf)  {
+int put_raid_cache(TagLineNumber tag, TagLineBlockNumber bnum, void *buf)  {
 
 	// Declares variables
-	int i;
 	CacheEntry *temp;
-	struct timeval tval;
 
-	// Updates the contents of an existing cache entry,
-	// if applicable
-	i = 0;
-	while (i < initialized) {
-		temp = cache[i];
-		if (temp->disk == dsk && temp->blockID == blk) {
-			memcpy(temp->buffer, buf, maxSize);
-			// Returns successfully
-			return (0);
-		}
-		i++;
+	// Stores the block as clean
+	pthread_mutex_lock(&cacheLock);
+	if ((temp = store_raid_cache(tag, bnum, buf)) != NULL) {
+		temp->dirty = 0;
+	}
+	pthread_mutex_unlock(&cacheLock);
+	if (temp == NULL) {
+		return (-1);
 	}
 
-	if (initialized == TAGLINE_CACHE_SIZE){
-		// Overwrites the entry of the least recently used entry
-		// (capacity miss)
-		gettimeofday(&tval, NULL);
-		leastRecent->clkTick = tval.tv_sec;
-		leastRecent->disk = dsk;
-		leastRecent->blockID = blk;
-		memcpy(leastRecent->buffer, buf, maxSize);
+	// Return successfully
+	return(0);
+}
 
-		// Redetermines the least recently used cache entry
-		calc_least_recent();
-	}
-	else {
-		// Creates a new cache entry
-		// (cold miss)
-		temp = (CacheEntry *) malloc(sizeof(CacheEntry));
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : put_raid_cache_blocks
+// Description  : Put a run of consecutive blocks into the block cache, one
+//                slot per block, as put_raid_cache does
+//
+// Inputs       : tag - this is the tagline of the blocks to cache
+//                bnum - this is the number of the first tagline block to cache
+//                blks - the number of blocks
+//                buf - the blocks to insert into the cache
+// Outputs      : 0 if successful, -1 if failure
 
-		if (temp == NULL) {
-			logMessage(LOG_ERROR_LEVEL, "Memory is not allocated successfully");
-			return (-1);
-		}
+int put_raid_cache_blocks(TagLineNumber tag, TagLineBlockNumber bnum, int blks, void *buf) {
 
-		// Creates space for the cache data
-		temp->buffer = (int *) malloc(maxSize);
+	// Declares variables
+	CacheEntry *temp;
+	int i;
 
-		if (temp->buffer == NULL) {
-			logMessage(LOG_ERROR_LEVEL, "Memory is not allocated successfully");
+	pthread_mutex_lock(&cacheLock);
+	for (i = 0; i < blks; i++) {
+		if ((temp = store_raid_cache(tag, bnum + i, &((char *) buf)[i * RAID_BLOCK_SIZE])) == NULL) {
+			pthread_mutex_unlock(&cacheLock);
 			return (-1);
 		}
+		temp->dirty = 0;
+	}
+	pthread_mutex_unlock(&cacheLock);
 
-		// Enters information into cache entry
-		gettimeofday(&tval, NULL);
-		temp->clkTick = tval.tv_sec;
-		temp->disk = dsk;
-		temp->blockID = blk;
-		memcpy(temp->buffer, buf, maxSize);
+	// Return successfully
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : put_raid_cache_dirty
+// Description  : Put a run of blocks into the cache that has not been written
+//                to RAID yet. They are written to the given primary and mirror
+//                copies when evicted or flushed; until then later writes
+//                overwrite them in memory, and may move them to other copies.
+//
+// Inputs       : tag - this is the tagline of the blocks to cache
+//                bnum - this is the number of the first tagline block to cache
+//                dsk - the disk number of the primary copy
+//                blk - the first block number of the primary copy
+//                dskCopy - the disk number of the mirror copy
+//                blkCopy - the first block number of the mirror copy
+//                blks - the number of blocks
+//                buf - the blocks to insert into the cache
+// Outputs      : 0 if successful, -1 if failure
 
-		// Adds cache entry to cache
-		cache[initialized] = temp;
+int put_raid_cache_dirty(TagLineNumber tag, TagLineBlockNumber bnum, RAIDDiskID dsk, RAIDBlockID blk,
+		RAIDDiskID dskCopy, RAIDBlockID blkCopy, int blks, void *buf) {
 
-		// Initializes least recently used cache to the very first
-		// entry in the cache
-		if (initialized == 0) leastRecent = cache[0];
+	// Declares variables
+	CacheEntry *temp;
+	int i;
 
-		// Increment initialized statistic
-		initialized++;
+	// Stores each block and marks it dirty
+	pthread_mutex_lock(&cacheLock);
+	for (i = 0; i < blks; i++) {
+		if ((temp = store_raid_cache(tag, bnum + i, &((char *) buf)[i * RAID_BLOCK_SIZE])) == NULL) {
+			pthread_mutex_unlock(&cacheLock);
+			return (-1);
+		}
+		temp->dirty = 1;
+		temp->disk = dsk;
+		temp->blockID = blk + i;
+		temp->diskCopy = dskCopy;
+		temp->blockIDCopy = blkCopy + i;
 	}
+	pthread_mutex_unlock(&cacheLock);
 
 	// Return successfully
 	return(0);
@@ -180,60 +407,999 @@ int put_raid_cache(RAIDDiskID dsk, RAIDBlockID blk, void *buf)  {
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : get_raid_cache
-// Description  : Get an object from the cache (and return it)
+// Description  : Get an object from the cache (and return it). The block may
+//                be evicted by another thread once this returns; use
+//                copy_raid_cache to read its contents.
 //
-// Inputs       : dsk - this is the disk number of the block to find
-//                blk - this is the block number of the block to find
+// Inputs       : tag - this is the tagline of the block to find
+//                bnum - this is the tagline block number of the block to find
 // Outputs      : pointer to cached object or NULL if not found
 
-void * get_raid_cache(RAIDDiskID dsk, RAIDBlockID blk) {
+void * get_raid_cache(TagLineNumber tag, TagLineBlockNumber bnum) {
 
 	// Declares variables
-	int i;
 	CacheEntry *temp;
-	struct timeval tval;
 
 	// Examines the cache if the entry exists
-	i = 0;
-	while (i < initialized) {
-		temp = cache[i];
-		if (temp->disk == dsk && temp->blockID == blk) {
-			// Updates the clock tick for the cache entry
-			gettimeofday(&tval, NULL);
-			temp->clkTick = tval.tv_sec;
+	pthread_mutex_lock(&cacheLock);
+	if ((temp = find_raid_cache(tag, bnum)) == NULL) {
+		// Return NULL
+		pthread_mutex_unlock(&cacheLock);
+		return(NULL);
+	}
+
+	// Tells the policy the entry was used
+	policy->hit(temp);
+	pthread_mutex_unlock(&cacheLock);
+
+	// Return the address to cached data
+	return (temp->buffer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : copy_raid_cache
+// Description  : Copies a block out of the cache if it is there
+//
+// Inputs       : tag - this is the tagline of the block to find
+//                bnum - this is the tagline block number of the block to find
+//                buf - the buffer to copy the block into
+// Outputs      : 0 if the block was copied, -1 if it is not cached
+
+int copy_raid_cache(TagLineNumber tag, TagLineBlockNumber bnum, void *buf) {
+
+	// Declares variables
+	CacheEntry *temp;
+
+	pthread_mutex_lock(&cacheLock);
+	if ((temp = find_raid_cache(tag, bnum)) == NULL) {
+		pthread_mutex_unlock(&cacheLock);
+		return (-1);
+	}
+
+	// Tells the policy the entry was used and copies it out
+	policy->hit(temp);
+	memcpy(buf, temp->buffer, RAID_BLOCK_SIZE);
+	pthread_mutex_unlock(&cacheLock);
+
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pin_raid_cache
+// Description  : Lends out the cached copy of a block without copying it. The
+//                block is not evicted or changed until unpin_raid_cache; a
+//                later write to it goes to a new entry. At most half of the
+//                cache can be pinned at once.
+//
+// Inputs       : tag - this is the tagline of the block to pin
+//                bnum - this is the tagline block number of the block to pin
+//                buf - the block to cache first if it is not cached, or NULL
+// Outputs      : pointer to the cached block or NULL if not cached or if too
+//                many blocks are pinned
+
+const void *pin_raid_cache(TagLineNumber tag, TagLineBlockNumber bnum, void *buf) {
+
+	// Declares variables
+	CacheEntry *temp;
+
+	pthread_mutex_lock(&cacheLock);
+	temp = find_raid_cache(tag, bnum);
+	if (temp == NULL && buf != NULL) {
+		temp = store_raid_cache(tag, bnum, buf);
+	}
+	if (temp == NULL || (temp->pins == 0 && pinnedEntries >= maxItems / 2)) {
+		pthread_mutex_unlock(&cacheLock);
+		return (NULL);
+	}
+
+	if (temp->pins++ == 0) {
+		pinnedEntries++;
+	}
+	policy->hit(temp);
+	pthread_mutex_unlock(&cacheLock);
+
+	return (temp->buffer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unpin_raid_cache
+// Description  : Releases a block lent out by pin_raid_cache
+//
+// Inputs       : block - the pointer returned by pin_raid_cache
+// Outputs      : none
+
+void unpin_raid_cache(const void *block) {
+
+	// Declares variables
+	CacheEntry *temp;
+
+	// The slot of the block in the arena is the index of its entry
+	pthread_mutex_lock(&cacheLock);
+	temp = &cache[((const char *) block - arena) / RAID_BLOCK_SIZE];
+	if (--temp->pins == 0) {
+		pinnedEntries--;
+
+		// Frees an entry that was replaced or dropped while it was pinned
+		if (temp->detached) {
+			temp->detached = 0;
+			temp->next = freeEntries;
+			freeEntries = temp;
+		}
+	}
+	pthread_mutex_unlock(&cacheLock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : invalidate_raid_cache
+// Description  : Drops a run of blocks from the cache without writing them
+//                back, e.g. once they have been unmapped or truncated away
+//
+// Inputs       : tag - this is the tagline of the blocks
+//                bnum - this is the number of the first tagline block
+//                blks - the number of blocks
+// Outputs      : the number of blocks dropped
+
+int invalidate_raid_cache(TagLineNumber tag, TagLineBlockNumber bnum, int blks) {
+
+	// Declares variables
+	CacheEntry *temp;
+	int i, dropped = 0;
 
-			// Redetermines the least recently used cache entry
-			// if the previous one was accessed again
-			if (leastRecent == temp) calc_least_recent();
+	pthread_mutex_lock(&cacheLock);
+	for (i = 0; i < blks; i++) {
+		// Forgets an eviction of the block, as it no longer holds what was evicted
+		if ((temp = find_ghost_raid_cache(tag, bnum + i)) != NULL) {
+			forget_raid_cache(temp);
+		}
+		if ((temp = find_raid_cache(tag, bnum + i)) == NULL) {
+			continue;
+		}
 
-			// Return the address to cached data
-			return (temp->buffer);
+		// Moves the entry to the free list, or leaves it to its last release
+		unlink_raid_cache(temp);
+		temp->dirty = 0;
+		if (temp->pins > 0) {
+			temp->detached = 1;
 		}
-		i++;
+		else {
+			temp->next = freeEntries;
+			freeEntries = temp;
+		}
+		dropped++;
 	}
+	pthread_mutex_unlock(&cacheLock);
 
-	// Return NULL
-	return(NULL);
+	return (dropped);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cached_raid_cache
+// Description  : Tells whether a block is cached. Unlike get_raid_cache this
+//                is not a use of the block, so the policy is left as it is.
+//
+// Inputs       : tag - this is the tagline of the block to find
+//                bnum - this is the tagline block number of the block to find
+// Outputs      : 1 if the block is cached, 0 otherwise
+
+int cached_raid_cache(TagLineNumber tag, TagLineBlockNumber bnum) {
+
+	// Declares variables
+	int cached;
+
+	pthread_mutex_lock(&cacheLock);
+	cached = (find_raid_cache(tag, bnum) != NULL);
+	pthread_mutex_unlock(&cacheLock);
+
+	return (cached);
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : calc_least_recent
-// Description  : Determines the least recently accessed entry
+// Function     : dirty_raid_cache
+// Description  : Tells whether any block of a run is held dirty in the cache,
+//                i.e. RAID does not hold its current contents yet
 //
+// Inputs       : tag - this is the tagline of the blocks
+//                bnum - this is the number of the first tagline block
+//                blks - the number of blocks
+// Outputs      : 1 if a block of the run is dirty, 0 otherwise
 
-void calc_least_recent() {
+int dirty_raid_cache(TagLineNumber tag, TagLineBlockNumber bnum, int blks) {
 
-	// Declares varables
+	// Declares variables
 	CacheEntry *temp;
-	int i = 1;
-	
-	// Searches for the least recently used cache entry
-	leastRecent = cache[0];
-	while (i < initialized) {
-		temp = cache[i];
-		if (temp->clkTick > leastRecent->clkTick) leastRecent = temp;
-		i++;
+	int i, dirty = 0;
+
+	pthread_mutex_lock(&cacheLock);
+	for (i = 0; i < blks && !dirty; i++) {
+		temp = find_raid_cache(tag, bnum + i);
+		dirty = (temp != NULL && temp->dirty);
+	}
+	pthread_mutex_unlock(&cacheLock);
+
+	return (dirty);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : flush_raid_cache
+// Description  : Writes every dirty block to its primary and mirror copies and
+//                marks it clean. Blocks are sorted by disk and block number so
+//                neighbouring blocks go out in a single RAID write.
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int flush_raid_cache(void) {
+
+	// Declares variables
+	int result;
+
+	pthread_mutex_lock(&cacheLock);
+	result = write_back_raid_cache();
+	pthread_mutex_unlock(&cacheLock);
+
+	return (result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : write_back_raid_cache
+// Description  : Writes back the dirty blocks as flush_raid_cache does, with
+//                the cache lock already held
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int write_back_raid_cache(void) {
+
+	// Declares variables
+	int i, count = 0, result = 0;
+	FlushBlock *primary, *mirror;
+	CacheEntry *temp;
+
+	// Lists the dirty blocks for both copies
+	primary = (FlushBlock *) malloc((initialized + 1) * sizeof(FlushBlock));
+	mirror = (FlushBlock *) malloc((initialized + 1) * sizeof(FlushBlock));
+	if (primary == NULL || mirror == NULL) {
+		logMessage(LOG_ERROR_LEVEL, "Memory is not allocated successfully");
+		free(primary);
+		free(mirror);
+		return (-1);
+	}
+
+	for (i = 0; i < initialized; i++) {
+		temp = &cache[i];
+		if (!temp->dirty) continue;
+
+		primary[count].disk = temp->disk;
+		primary[count].blockID = temp->blockID;
+		primary[count].buffer = temp->buffer;
+		mirror[count].disk = temp->diskCopy;
+		mirror[count].blockID = temp->blockIDCopy;
+		mirror[count].buffer = temp->buffer;
+		count++;
+	}
+
+	// Writes both copies, then marks the blocks clean
+	if (count > 0) {
+		if (write_flush_blocks(primary, count) == -1 || write_flush_blocks(mirror, count) == -1) {
+			result = -1;
+		}
+		else {
+			for (i = 0; i < initialized; i++) {
+				cache[i].dirty = 0;
+			}
+			logMessage(LOG_INFO_LEVEL, "RAID cache wrote back %d dirty blocks.", count);
+		}
+	}
+
+	free(primary);
+	free(mirror);
+	return (result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : find_raid_cache
+// Description  : Finds the cache entry of a block in the hash index without
+//                changing its recency
+//
+// Inputs       : tag - this is the tagline of the block to find
+//                bnum - this is the tagline block number of the block to find
+// Outputs      : the cache entry or NULL if not found
+
+CacheEntry *find_raid_cache(TagLineNumber tag, TagLineBlockNumber bnum) {
+
+	// Declares variables
+	CacheEntry *temp;
+
+	// Walks the bucket of the block
+	temp = hashTable[hash_raid_cache(tag, bnum)];
+	while (temp != NULL) {
+		if (temp->tag == tag && temp->bnum == bnum) {
+			return (temp);
+		}
+		temp = temp->hashNext;
+	}
+
+	return (NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hash_raid_cache
+// Description  : Computes the hash bucket of a block
+//
+// Inputs       : tag - this is the tagline of the block
+//                bnum - this is the tagline block number of the block
+// Outputs      : the bucket index
+
+unsigned int hash_raid_cache(TagLineNumber tag, TagLineBlockNumber bnum) {
+	return (((bnum * 2654435761u) ^ (tag * 40503u)) & hashMask);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unhash_raid_cache
+// Description  : Removes an entry from its bucket chain
+//
+// Inputs       : table - the hash index of the entry (cached blocks or ghosts)
+//                entry - the entry to remove
+
+void unhash_raid_cache(CacheEntry **table, CacheEntry *entry) {
+
+	// Declares variables
+	CacheEntry **link;
+
+	link = &table[hash_raid_cache(entry->tag, entry->bnum)];
+	while (*link != entry) {
+		link = &(*link)->hashNext;
+	}
+	*link = entry->hashNext;
+	entry->hashNext = NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unlink_raid_cache
+// Description  : Removes an entry from its hash bucket and the lists of the
+//                replacement policy without remembering it as evicted
+//
+// Inputs       : entry - the entry to remove
+
+void unlink_raid_cache(CacheEntry *entry) {
+
+	unhash_raid_cache(hashTable, entry);
+	policy->remove(entry, 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : find_ghost_raid_cache
+// Description  : Finds the ghost entry of a block that was evicted recently
+//
+// Inputs       : tag - this is the tagline of the block to find
+//                bnum - this is the tagline block number of the block to find
+// Outputs      : the ghost entry or NULL if not found
+
+CacheEntry *find_ghost_raid_cache(TagLineNumber tag, TagLineBlockNumber bnum) {
+
+	// Declares variables
+	CacheEntry *temp;
+
+	temp = ghostTable[hash_raid_cache(tag, bnum)];
+	while (temp != NULL) {
+		if (temp->tag == tag && temp->bnum == bnum) {
+			return (temp);
+		}
+		temp = temp->hashNext;
+	}
+
+	return (NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : remember_raid_cache
+// Description  : Remembers the address of an evicted block in a ghost list.
+//                When every ghost entry is in use, the oldest one of the
+//                longer ghost list is forgotten first.
+//
+// Inputs       : entry - the entry being evicted
+//                list - the ghost list to remember it in
+
+void remember_raid_cache(CacheEntry *entry, int list) {
+
+	// Declares variables
+	CacheEntry *ghost;
+	unsigned int bucket;
+
+	if (freeGhosts == NULL) {
+		forget_raid_cache(lists[CACHE_FREQUENT_GHOSTS].size > lists[CACHE_RECENT_GHOSTS].size ?
+			lists[CACHE_FREQUENT_GHOSTS].tail : lists[CACHE_RECENT_GHOSTS].tail);
+	}
+	ghost = freeGhosts;
+	freeGhosts = ghost->next;
+
+	// Indexes the address and adds it to the front of the list
+	ghost->tag = entry->tag;
+	ghost->bnum = entry->bnum;
+	bucket = hash_raid_cache(ghost->tag, ghost->bnum);
+	ghost->hashNext = ghostTable[bucket];
+	ghostTable[bucket] = ghost;
+	push_raid_cache(ghost, list);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : forget_raid_cache
+// Description  : Drops a ghost entry and returns it to the free ghosts
+//
+// Inputs       : ghost - the ghost entry to drop
+
+void forget_raid_cache(CacheEntry *ghost) {
+
+	unhash_raid_cache(ghostTable, ghost);
+	pull_raid_cache(ghost);
+	ghost->next = freeGhosts;
+	freeGhosts = ghost;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : push_raid_cache
+// Description  : Links an entry in at the front of a list
+//
+// Inputs       : entry - the entry, which is in no list
+//                list - the list to add it to
+
+void push_raid_cache(CacheEntry *entry, int list) {
+
+	entry->list = list;
+	entry->prev = NULL;
+	entry->next = lists[list].head;
+	if (lists[list].head) lists[list].head->prev = entry; else lists[list].tail = entry;
+	lists[list].head = entry;
+	lists[list].size++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pull_raid_cache
+// Description  : Unlinks an entry from its list
+//
+// Inputs       : entry - the entry to unlink
+
+void pull_raid_cache(CacheEntry *entry) {
+
+	// Declares variables
+	CacheList *list = &lists[entry->list];
+
+	if (entry->prev) entry->prev->next = entry->next; else list->head = entry->next;
+	if (entry->next) entry->next->prev = entry->prev; else list->tail = entry->prev;
+	entry->prev = NULL;
+	entry->next = NULL;
+	list->size--;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : oldest_raid_cache
+// Description  : Finds the least recently used entry of a list that is not
+//                pinned
+//
+// Inputs       : list - the list to search
+// Outputs      : the entry or NULL if every entry of the list is pinned
+
+CacheEntry *oldest_raid_cache(int list) {
+
+	// Declares variables
+	CacheEntry *temp;
+
+	for (temp = lists[list].tail; temp != NULL && temp->pins > 0; temp = temp->prev);
+	return (temp);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : claim_raid_cache
+// Description  : Takes an entry for a new block: a freed entry, the next
+//                unused one, or the one the replacement policy picks, which
+//                is evicted. A dirty victim causes the dirty blocks to be
+//                written back first.
+//
+// Inputs       : ghost - the ghost entry of the new block, or NULL
+// Outputs      : the entry, out of the index and the policy, or NULL on failure
+
+CacheEntry *claim_raid_cache(CacheEntry *ghost) {
+
+	// Declares variables
+	CacheEntry *temp;
+
+	if (freeEntries != NULL) {
+		// Reuses an entry freed by an invalidation
+		temp = freeEntries;
+		freeEntries = temp->next;
+	}
+	else if (initialized == maxItems){
+		// Lets the policy pick an entry that is not pinned. At most half of
+		// the entries can be pinned, so there always is one.
+		temp = policy->victim(ghost);
+
+		// Writes back the dirty blocks as one batch before the entry is reused
+		if (temp->dirty && write_back_raid_cache() == -1) {
+			logMessage(LOG_ERROR_LEVEL, "Dirty blocks could not be written back");
+			return (NULL);
+		}
+
+		// Takes the entry over (capacity miss), which the policy may remember
+		unhash_raid_cache(hashTable, temp);
+		policy->remove(temp, 1);
+	}
+	else {
+		// Takes the next unused entry and its arena slot
+		// (cold miss)
+		temp = &cache[initialized];
+		temp->buffer = (int *) &arena[(size_t) initialized * RAID_BLOCK_SIZE];
+
+		// Increment initialized statistic
+		initialized++;
+	}
+
+	return (temp);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : store_raid_cache
+// Description  : Copies a block into its cache entry, creating the entry or
+//                evicting another one as necessary
+//
+// Inputs       : tag - this is the tagline of the block to cache
+//                bnum - this is the tagline block number of the block to cache
+//                buf - the buffer to insert into the cache
+// Outputs      : the cache entry or NULL on failure
+
+CacheEntry *store_raid_cache(TagLineNumber tag, TagLineBlockNumber bnum, void *buf) {
+
+	// Declares variables
+	CacheEntry *temp, *replaced = NULL;
+	unsigned int bucket;
+
+	// Updates the contents of an existing cache entry,
+	// if applicable
+	if ((temp = find_raid_cache(tag, bnum)) != NULL) {
+		if (temp->pins == 0) {
+			memcpy(temp->buffer, buf, RAID_BLOCK_SIZE);
+			policy->hit(temp);
+			// Returns successfully
+			return (temp);
+		}
+
+		// A pinned block keeps its old contents for its readers; the new
+		// contents take a new entry, which replaces it in the index
+		replaced = temp;
+	}
+
+	if ((temp = claim_raid_cache(find_ghost_raid_cache(tag, bnum))) == NULL) {
+		return (NULL);
+	}
+	temp->tag = tag;
+	temp->bnum = bnum;
+	temp->dirty = 0;
+	temp->detached = 0;
+	temp->referenced = 0;
+	temp->prev = NULL;
+	temp->next = NULL;
+	memcpy(temp->buffer, buf, RAID_BLOCK_SIZE);
+
+	// Detaches a replaced pinned entry and hands its dirty state to the new one
+	if (replaced != NULL) {
+		unlink_raid_cache(replaced);
+		replaced->detached = 1;
+		if (replaced->dirty) {
+			temp->dirty = 1;
+			temp->disk = replaced->disk;
+			temp->blockID = replaced->blockID;
+			temp->diskCopy = replaced->diskCopy;
+			temp->blockIDCopy = replaced->blockIDCopy;
+			replaced->dirty = 0;
+		}
+	}
+
+	// Adds the entry to its bucket and hands it to the policy. The eviction
+	// looked up the ghost before it made room, so it is looked up again.
+	bucket = hash_raid_cache(tag, bnum);
+	temp->hashNext = hashTable[bucket];
+	hashTable[bucket] = temp;
+	policy->admit(temp, find_ghost_raid_cache(tag, bnum));
+
+	// A rewritten pinned block counts as used again
+	if (replaced != NULL) {
+		policy->hit(temp);
+	}
+
+	// Return successfully
+	return(temp);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : compare_flush_blocks
+// Description  : Orders flush blocks by disk and then block number (qsort)
+//
+// Inputs       : a, b - the flush blocks to compare
+// Outputs      : negative, zero or positive as a sorts before, with or after b
+
+int compare_flush_blocks(const void *a, const void *b) {
+
+	const FlushBlock *x = (const FlushBlock *) a, *y = (const FlushBlock *) b;
+
+	if (x->disk != y->disk) return (x->disk < y->disk) ? -1 : 1;
+	if (x->blockID != y->blockID) return (x->blockID < y->blockID) ? -1 : 1;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : write_flush_blocks
+// Description  : Writes a list of blocks to RAID, merging runs of consecutive
+//                blocks on the same disk into writes of up to RAID_MAX_XFER
+//
+// Inputs       : blocks - the blocks to write (sorted in place)
+//                count - the number of blocks
+// Outputs      : 0 if successful, -1 if failure
+
+int write_flush_blocks(FlushBlock *blocks, int count) {
+
+	// Declares variables
+	int i, run;
+	char *runBuf;
+	RAIDOpCode response;
+	int arr[RAID_OPCODE_MAXVAL] = {0};
+
+	runBuf = (char *) malloc(RAID_MAX_XFER * RAID_BLOCK_SIZE);
+	if (runBuf == NULL) {
+		logMessage(LOG_ERROR_LEVEL, "Memory is not allocated successfully");
+		return (-1);
+	}
+
+	qsort(blocks, count, sizeof(FlushBlock), compare_flush_blocks);
+
+	// Writes a block that several tag blocks share (deduplicated) only once
+	for (i = 1, run = 1; i < count; i++) {
+		if (blocks[i].disk != blocks[run - 1].disk || blocks[i].blockID != blocks[run - 1].blockID) {
+			blocks[run++] = blocks[i];
+		}
+	}
+	count = run;
+
+	i = 0;
+	while (i < count) {
+		// Gathers the longest run of consecutive blocks starting here
+		run = 0;
+		do {
+			memcpy(&runBuf[run * RAID_BLOCK_SIZE], blocks[i + run].buffer, RAID_BLOCK_SIZE);
+			run++;
+		} while (i + run < count && run < RAID_MAX_XFER &&
+			blocks[i + run].disk == blocks[i].disk &&
+			blocks[i + run].blockID == blocks[i].blockID + run);
+
+		// Writes the run
+		response = create_raid_request(RAID_WRITE, run, blocks[i].disk, 0, 0, blocks[i].blockID, runBuf);
+		extract_raid_response(response, arr, RAID_OPCODE_MAXVAL);
+		if (arr[RAID_OPCODE_STATUS] == 1) {
+			logMessage(LOG_ERROR_LEVEL, "A RAID command failed while writing back the cache.");
+			free(runBuf);
+			return (-1);
+		}
+
+		i += run;
+	}
+
+	free(runBuf);
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hit_lru_raid_cache
+// Description  : LRU: moves a used entry to the front of its list
+//
+// Inputs       : entry - the entry that was used
+
+void hit_lru_raid_cache(CacheEntry *entry) {
+
+	if (lists[entry->list].head != entry) {
+		pull_raid_cache(entry);
+		push_raid_cache(entry, CACHE_RECENT);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : admit_lru_raid_cache
+// Description  : LRU and CLOCK: adds a new entry to the front of the list
+//
+// Inputs       : entry - the new entry
+//                ghost - unused, these policies keep no ghosts
+
+void admit_lru_raid_cache(CacheEntry *entry, CacheEntry *ghost) {
+
+	(void) ghost;
+	push_raid_cache(entry, CACHE_RECENT);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : victim_lru_raid_cache
+// Description  : LRU: picks the least recently used entry that is not pinned
+//
+// Inputs       : ghost - unused, this policy keeps no ghosts
+// Outputs      : the entry to evict
+
+CacheEntry *victim_lru_raid_cache(CacheEntry *ghost) {
+
+	(void) ghost;
+	return (oldest_raid_cache(CACHE_RECENT));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : remove_lru_raid_cache
+// Description  : LRU and CLOCK: takes an entry out of the list
+//
+// Inputs       : entry - the entry to remove
+//                evicted - unused, these policies keep no ghosts
+
+void remove_lru_raid_cache(CacheEntry *entry, int evicted) {
+
+	(void) evicted;
+	pull_raid_cache(entry);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hit_clock_raid_cache
+// Description  : CLOCK: sets the reference bit of a used entry, which leaves
+//                the list alone so hits are cheap
+//
+// Inputs       : entry - the entry that was used
+
+void hit_clock_raid_cache(CacheEntry *entry) {
+	entry->referenced = 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : victim_clock_raid_cache
+// Description  : CLOCK: the hand is the end of the list. Entries under the
+//                hand that were used since it last passed, or are pinned,
+//                lose their reference bit and go round again; the first one
+//                that is neither is picked. One turn clears every bit, so
+//                this ends within two turns.
+//
+// Inputs       : ghost - unused, this policy keeps no ghosts
+// Outputs      : the entry to evict
+
+CacheEntry *victim_clock_raid_cache(CacheEntry *ghost) {
+
+	// Declares variables
+	CacheEntry *temp;
+
+	(void) ghost;
+	for (temp = lists[CACHE_RECENT].tail; temp->pins > 0 || temp->referenced; temp = lists[CACHE_RECENT].tail) {
+		temp->referenced = 0;
+		pull_raid_cache(temp);
+		push_raid_cache(temp, CACHE_RECENT);
+	}
+
+	return (temp);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hit_two_queue_raid_cache
+// Description  : 2Q: moves a used entry of Am to its front. Entries still in
+//                A1in stay where they are, since a block read several times
+//                in a row (e.g. by a scan) has not proven to be hot.
+//
+// Inputs       : entry - the entry that was used
+
+void hit_two_queue_raid_cache(CacheEntry *entry) {
+
+	if (entry->list == CACHE_FREQUENT && lists[CACHE_FREQUENT].head != entry) {
+		pull_raid_cache(entry);
+		push_raid_cache(entry, CACHE_FREQUENT);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : admit_two_queue_raid_cache
+// Description  : 2Q: adds a new entry to A1in, or straight to Am if it was
+//                evicted from A1in recently and is needed again
+//
+// Inputs       : entry - the new entry
+//                ghost - the entry of the block in A1out, or NULL
+
+void admit_two_queue_raid_cache(CacheEntry *entry, CacheEntry *ghost) {
+
+	if (ghost != NULL) {
+		forget_raid_cache(ghost);
+		push_raid_cache(entry, CACHE_FREQUENT);
+	}
+	else {
+		push_raid_cache(entry, CACHE_RECENT);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : victim_two_queue_raid_cache
+// Description  : 2Q: evicts from the end of A1in while it holds more than its
+//                share of the cache and from the end of Am otherwise, so a
+//                scan only ever displaces A1in
+//
+// Inputs       : ghost - unused, the share of A1in is fixed
+// Outputs      : the entry to evict
+
+CacheEntry *victim_two_queue_raid_cache(CacheEntry *ghost) {
+
+	// Declares variables
+	CacheEntry *temp = NULL;
+
+	(void) ghost;
+	if (lists[CACHE_RECENT].size > maxItems / TWO_QUEUE_IN_SHARE) {
+		temp = oldest_raid_cache(CACHE_RECENT);
+	}
+	if (temp == NULL) {
+		temp = oldest_raid_cache(CACHE_FREQUENT);
+	}
+	if (temp == NULL) {
+		temp = oldest_raid_cache(CACHE_RECENT);
+	}
+
+	return (temp);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : remove_two_queue_raid_cache
+// Description  : 2Q: takes an entry out of its list. Evictions from A1in are
+//                remembered in A1out, which is kept to its share of the cache.
+//
+// Inputs       : entry - the entry to remove
+//                evicted - non-zero if the entry is being evicted
+
+void remove_two_queue_raid_cache(CacheEntry *entry, int evicted) {
+
+	// Declares variables
+	int list = entry->list;
+
+	pull_raid_cache(entry);
+	if (evicted && list == CACHE_RECENT) {
+		remember_raid_cache(entry, CACHE_RECENT_GHOSTS);
+		while (lists[CACHE_RECENT_GHOSTS].size > maxItems / TWO_QUEUE_OUT_SHARE) {
+			forget_raid_cache(lists[CACHE_RECENT_GHOSTS].tail);
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hit_arc_raid_cache
+// Description  : ARC: moves a used entry to the front of T2
+//
+// Inputs       : entry - the entry that was used
+
+void hit_arc_raid_cache(CacheEntry *entry) {
+
+	if (lists[CACHE_FREQUENT].head != entry) {
+		pull_raid_cache(entry);
+		push_raid_cache(entry, CACHE_FREQUENT);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : admit_arc_raid_cache
+// Description  : ARC: adds a new entry to T1, or to T2 if it was evicted
+//                recently. A block evicted from T1 too early grows the target
+//                size of T1, one evicted from T2 too early shrinks it. B1 is
+//                then trimmed so T1 and B1 hold at most the size of the
+//                cache, and the ghosts so all lists hold at most twice of it.
+//
+// Inputs       : entry - the new entry
+//                ghost - the entry of the block in B1 or B2, or NULL
+
+void admit_arc_raid_cache(CacheEntry *entry, CacheEntry *ghost) {
+
+	// Declares variables
+	int recentGhosts = lists[CACHE_RECENT_GHOSTS].size, frequentGhosts = lists[CACHE_FREQUENT_GHOSTS].size;
+
+	if (ghost == NULL) {
+		push_raid_cache(entry, CACHE_RECENT);
+	}
+	else {
+		// Adapts the target by the ratio of the ghost lists
+		if (ghost->list == CACHE_RECENT_GHOSTS) {
+			targetRecent += (frequentGhosts > recentGhosts) ? frequentGhosts / recentGhosts : 1;
+			if (targetRecent > maxItems) targetRecent = maxItems;
+		}
+		else {
+			targetRecent -= (recentGhosts > frequentGhosts) ? recentGhosts / frequentGhosts : 1;
+			if (targetRecent < 0) targetRecent = 0;
+		}
+		forget_raid_cache(ghost);
+		push_raid_cache(entry, CACHE_FREQUENT);
+	}
+
+	// Trims the ghost lists
+	while (lists[CACHE_RECENT_GHOSTS].size > 0 &&
+			lists[CACHE_RECENT].size + lists[CACHE_RECENT_GHOSTS].size > maxItems) {
+		forget_raid_cache(lists[CACHE_RECENT_GHOSTS].tail);
+	}
+	while (lists[CACHE_RECENT_GHOSTS].size + lists[CACHE_FREQUENT_GHOSTS].size > 0 &&
+			lists[CACHE_RECENT].size + lists[CACHE_FREQUENT].size +
+			lists[CACHE_RECENT_GHOSTS].size + lists[CACHE_FREQUENT_GHOSTS].size > 2 * maxItems) {
+		forget_raid_cache(lists[CACHE_FREQUENT_GHOSTS].size > 0 ?
+			lists[CACHE_FREQUENT_GHOSTS].tail : lists[CACHE_RECENT_GHOSTS].tail);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : victim_arc_raid_cache
+// Description  : ARC: evicts from the end of T1 while it is above its target
+//                size (or at it, for a block coming back from B2) and from
+//                the end of T2 otherwise. The other list is used when every
+//                entry of the chosen one is pinned.
+//
+// Inputs       : ghost - the entry of the new block in B1 or B2, or NULL
+// Outputs      : the entry to evict
+
+CacheEntry *victim_arc_raid_cache(CacheEntry *ghost) {
+
+	// Declares variables
+	CacheEntry *temp;
+	int recent = lists[CACHE_RECENT].size;
+
+	if (recent > 0 && (recent > targetRecent ||
+			(ghost != NULL && ghost->list == CACHE_FREQUENT_GHOSTS && recent == targetRecent))) {
+		if ((temp = oldest_raid_cache(CACHE_RECENT)) == NULL) {
+			temp = oldest_raid_cache(CACHE_FREQUENT);
+		}
+	}
+	else if ((temp = oldest_raid_cache(CACHE_FREQUENT)) == NULL) {
+		temp = oldest_raid_cache(CACHE_RECENT);
+	}
+
+	return (temp);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : remove_arc_raid_cache
+// Description  : ARC: takes an entry out of T1 or T2, remembering an eviction
+//                in B1 or B2 respectively
+//
+// Inputs       : entry - the entry to remove
+//                evicted - non-zero if the entry is being evicted
+
+void remove_arc_raid_cache(CacheEntry *entry, int evicted) {
+
+	// Declares variables
+	int list = entry->list;
+
+	pull_raid_cache(entry);
+	if (evicted) {
+		remember_raid_cache(entry, list == CACHE_RECENT ? CACHE_RECENT_GHOSTS : CACHE_FREQUENT_GHOSTS);
 	}
 }
@@ -5,7 +5,8 @@
 //
 //  File           : raid_cache.h
 //  Description    : This is the header file for the implementation of the
-//                   block cache for the TAGLINE driver.
+//                   block cache for the TAGLINE driver. Blocks are cached by
+//                   tagline and tagline block, wherever RAID stores them.
 //
 //  Author         : Patrick McDaniel
 //  Last Modified  : Fri Oct  9 17:14:45 PDT 2015
@@ -14,25 +15,69 @@
 // Includes
 #include <tagline_driver.h>
 
+// These are the replacement policies of the cache
+typedef enum {
+	CACHE_POLICY_LRU   = 0,  // Evict the least recently used block
+	CACHE_POLICY_CLOCK = 1,  // Evict the next block on the clock not used since the hand passed
+	CACHE_POLICY_2Q    = 2,  // Evict blocks used only once first (2Q, scan resistant)
+	CACHE_POLICY_ARC   = 3,  // Balance recency and frequency adaptively (ARC, scan resistant)
+	CACHE_POLICY_MAXVAL = 4, // Max value
+} CACHE_POLICY_TYPES;
+
 // Defines
 #define TAGLINE_CACHE_SIZE 1024
+#define TAGLINE_CACHE_POLICY CACHE_POLICY_LRU
 
 ///
 // Cache Interfaces
 
-int init_raid_cache(uint32_t max_blocks);
-	// Initialize the cache and note maximum blocks
+int init_raid_cache(uint32_t max_blocks, CACHE_POLICY_TYPES policy);
+	// Initialize the cache, note maximum blocks and the replacement policy
+
+const char *raid_cache_policy(void);
+	// Get the name of the replacement policy
 
 int close_raid_cache(void);
 	// Clear all of the contents of the cache, cleanup
 
-int put_raid_cache(RAIDDiskID dsk, RAIDBlockID blk, void *buf);
+int put_raid_cache(TagLineNumber tag, TagLineBlockNumber bnum, void *buf);
 	// Put an object into the object cache, evicting other items as necessary
 
-void * get_raid_cache(RAIDDiskID dsk, RAIDBlockID blk);
+void * get_raid_cache(TagLineNumber tag, TagLineBlockNumber bnum);
 	// Get an object from the cache (and return it)
 
-void calc_least_recent(void);
-	// Determines the least recently accessed entry
+int copy_raid_cache(TagLineNumber tag, TagLineBlockNumber bnum, void *buf);
+	// Copy a block out of the cache, 0 if found and -1 if not
+
+const void *pin_raid_cache(TagLineNumber tag, TagLineBlockNumber bnum, void *buf);
+	// Lend out a cached block, caching buf first if given, until it is unpinned
+
+void unpin_raid_cache(const void *block);
+	// Release a block lent out by pin_raid_cache
+
+int put_raid_cache_blocks(TagLineNumber tag, TagLineBlockNumber bnum, int blks, void *buf);
+	// Put a run of consecutive blocks into the cache
+
+int put_raid_cache_dirty(TagLineNumber tag, TagLineBlockNumber bnum, RAIDDiskID dsk, RAIDBlockID blk,
+		RAIDDiskID dskCopy, RAIDBlockID blkCopy, int blks, void *buf);
+	// Put a run of blocks into the cache that still has to be written to both copies
+
+int invalidate_raid_cache(TagLineNumber tag, TagLineBlockNumber bnum, int blks);
+	// Drop a run of blocks from the cache without writing them back
+
+int cached_raid_cache(TagLineNumber tag, TagLineBlockNumber bnum);
+	// Tell whether a block is cached, without counting it as a use
+
+int dirty_raid_cache(TagLineNumber tag, TagLineBlockNumber bnum, int blks);
+	// Tell whether any block of a run still has to be written back
+
+int flush_raid_cache(void);
+	// Write every dirty block back to RAID
+
+int set_raid_cache_write_back(int enabled);
+	// Turn write-back mode on or off
+
+int raid_cache_write_back(void);
+	// Is the cache in write-back mode?
 
 #endif
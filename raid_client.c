@@ -17,6 +17,8 @@
 #include <unistd.h>
 #include <assert.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 // Project Include Files
 #include <raid_network.h>
@@ -36,9 +38,83 @@ unsigned short raid_network_port = 0; // Port of CRUD server
 int sckt;
 struct sockaddr_in v4;
 
+// Requests from several threads share the socket as a pipeline. A thread sends
+// its request whole under the send lock and takes a ticket; the server answers
+// in order, so responses are read in ticket order under the receive lock. A
+// thread can send while another waits for its answer, and no thread ever waits
+// to receive while holding the send lock. A failed transfer leaves the stream
+// out of step, so every later request fails as well.
+pthread_mutex_t sendLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t recvLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t recvTurn = PTHREAD_COND_INITIALIZER;
+uint64_t nextTicket, servingTicket;
+atomic_int busBroken;
+
+// Function prototypes
+int sendBytes(void *buf, size_t len);
+int recvBytes(void *buf, size_t len);
+void takeTurn(uint64_t ticket);
+void finishTurn(int count);
+
 //
 // Functions
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : sendBytes
+// Description  : Writes a whole buffer to the server socket, continuing after
+//                short writes
+//
+// Inputs       : buf - the bytes to send
+//                len - the number of bytes
+// Outputs      : 0 if successful, -1 if failure
+
+int sendBytes(void *buf, size_t len) {
+
+	// Declares local variables
+	ssize_t sent;
+	size_t done = 0;
+
+	while (done < len) {
+		sent = write(sckt, &((char *) buf)[done], len - done);
+		if (sent <= 0) {
+			if (sent == -1 && errno == EINTR) continue;
+			return (-1);
+		}
+		done += sent;
+	}
+
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : recvBytes
+// Description  : Reads a whole buffer from the server socket, continuing after
+//                short reads (large transfers arrive in several segments)
+//
+// Inputs       : buf - where to place the bytes
+//                len - the number of bytes
+// Outputs      : 0 if successful, -1 if failure
+
+int recvBytes(void *buf, size_t len) {
+
+	// Declares local variables
+	ssize_t got;
+	size_t done = 0;
+
+	while (done < len) {
+		got = read(sckt, &((char *) buf)[done], len - done);
+		if (got <= 0) {
+			if (got == -1 && errno == EINTR) continue;
+			return (-1);
+		}
+		done += got;
+	}
+
+	return (0);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : client_raid_bus_request
@@ -49,6 +125,9 @@ struct sockaddr_in v4;
 //                2) send any request to the server, returning results
 //                3) if CLOSE, will close the connection
 //
+//                It may be called from several threads at once; their requests
+//                are pipelined on the connection.
+//
 // Inputs       : op - the request opcode for the command
 //                buf - the block to be read/written from (READ/WRITE)
 // Outputs      : the response structure encoded as needed
@@ -57,15 +136,17 @@ RAIDOpCode client_raid_bus_request(RAIDOpCode op, void *buf) {
 
 	// Declares local variables
 	RAIDOpCode opNet;
-	int requestType, blks;
-	uint64_t bufLen, bufLenNet;
+	int requestType, blks, failed = 0;
+	uint64_t bufLen, sendLen, bufLenNet, ticket;
 
 	// Extracts the opcode
 	requestType = op >> SHIFT_FOR_REQUEST;
 	blks = (op >> SHIFT_FOR_BLOCKS) & STRUCTURE_FOR_BLOCKS;
 
-	// Assigns the buffer length
+	// Assigns the buffer length. Only a write carries blocks to the server;
+	// the blocks of a read just come back with the response.
 	bufLen = blks * RAID_BLOCK_SIZE;
+	sendLen = (requestType == RAID_WRITE) ? bufLen : 0;
 
 	// Connects to a RAID server
 	if (requestType == RAID_INIT) {
@@ -92,43 +173,67 @@ RAIDOpCode client_raid_bus_request(RAIDOpCode op, void *buf) {
 			return op | FAILURE_STATUS;
 		}
 
+		// Starts a new pipeline on the new connection
+		nextTicket = 0;
+		servingTicket = 0;
+		busBroken = 0;
+
 		// Reassigns the buffer length
 		bufLen = 0;
+		sendLen = 0;
 	}
 	
 	// Converts opcode and buffer length into network byte order
 	opNet = htonll64(op);
-	bufLenNet = htonll64(bufLen);
+	bufLenNet = htonll64(sendLen);
 
 	// Sends the opcode, buffer length, and buffer for any RAID command
-	if (write(sckt, &opNet, (size_t) 8) != (ssize_t) 8) {
+	pthread_mutex_lock(&sendLock);
+	ticket = nextTicket++;
+	if (busBroken) {
+		failed = 1;
+	}
+	else if (sendBytes(&opNet, (size_t) 8) == -1) {
 		logMessage(LOG_ERROR_LEVEL, "Writing opcode failed");
-		return op | FAILURE_STATUS;
+		failed = 1;
 	}
-
-	if (write(sckt, &bufLenNet, (size_t) 8) != (ssize_t) 8) {
+	else if (sendBytes(&bufLenNet, (size_t) 8) == -1) {
 		logMessage(LOG_ERROR_LEVEL, "Writing buffer length failed");
-		return op | FAILURE_STATUS;
+		failed = 1;
 	}
-
-	if (write(sckt, buf, (size_t) bufLen) != (ssize_t) bufLen) {
+	else if (sendBytes(buf, (size_t) sendLen) == -1) {
 		logMessage(LOG_ERROR_LEVEL, "Writing buffer failed");
-		return op | FAILURE_STATUS;
+		failed = 1;
+	}
+	if (failed) {
+		busBroken = 1;
 	}
+	pthread_mutex_unlock(&sendLock);
 
-	// Reads the opcode, buffer length, and buffer for any RAID command
-	if (read(sckt, &opNet, (size_t) 8) != (ssize_t) 8) {
+	// Reads the opcode, buffer length, and buffer for any RAID command once
+	// the responses to every earlier request have been read
+	takeTurn(ticket);
+	if (busBroken) {
+		failed = 1;
+	}
+	else if (recvBytes(&opNet, (size_t) 8) == -1) {
 		logMessage(LOG_ERROR_LEVEL, "Reading opcode failed.");
-		return op | FAILURE_STATUS;
+		failed = 1;
 	}
-
-	if (read(sckt, &bufLenNet, (size_t) 8) != (ssize_t) 8) {
+	else if (recvBytes(&bufLenNet, (size_t) 8) == -1) {
 		logMessage(LOG_ERROR_LEVEL, "Reading buffer length failed.");
-		return op | FAILURE_STATUS;
+		failed = 1;
 	}
-
-	if (read(sckt, buf, (size_t) bufLen) != (ssize_t) bufLen) {
+	else if (recvBytes(buf, (size_t) bufLen) == -1) {
 		logMessage(LOG_ERROR_LEVEL, "Reading buffer failed.");
+		failed = 1;
+	}
+	if (failed) {
+		busBroken = 1;
+	}
+	finishTurn(1);
+
+	if (failed) {
 		return op | FAILURE_STATUS;
 	}
 
@@ -146,3 +251,85 @@ RAIDOpCode client_raid_bus_request(RAIDOpCode op, void *buf) {
     	return op;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_raid_bus_pipeline
+// Description  : Sends several requests that carry no blocks (e.g. STATUS) to
+//                the server back to back and then collects their responses in
+//                order, so they cost one round trip instead of one each.
+//
+// Inputs       : ops - the request opcodes, replaced by the response opcodes
+//                count - the number of requests
+// Outputs      : 0 if successful, -1 if failure
+
+int client_raid_bus_pipeline(RAIDOpCode *ops, int count) {
+
+	// Declares local variables
+	RAIDOpCode opNet;
+	uint64_t bufLenNet, ticket;
+	int i, failed = 0;
+
+	// Sends every opcode with an empty buffer, taking consecutive tickets
+	bufLenNet = htonll64((uint64_t) 0);
+	pthread_mutex_lock(&sendLock);
+	ticket = nextTicket;
+	nextTicket += count;
+	for (i = 0; i < count && !failed; i++) {
+		opNet = htonll64(ops[i]);
+		if (busBroken || sendBytes(&opNet, (size_t) 8) == -1 || sendBytes(&bufLenNet, (size_t) 8) == -1) {
+			logMessage(LOG_ERROR_LEVEL, "Writing pipelined request failed");
+			failed = 1;
+			busBroken = 1;
+		}
+	}
+	pthread_mutex_unlock(&sendLock);
+
+	// Reads the responses, which arrive in the order the requests were sent
+	takeTurn(ticket);
+	for (i = 0; i < count && !failed; i++) {
+		if (busBroken || recvBytes(&opNet, (size_t) 8) == -1 || recvBytes(&bufLenNet, (size_t) 8) == -1) {
+			logMessage(LOG_ERROR_LEVEL, "Reading pipelined response failed.");
+			failed = 1;
+			busBroken = 1;
+		}
+		else {
+			ops[i] = ntohll64(opNet);
+		}
+	}
+	finishTurn(count);
+
+	return (failed ? -1 : 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : takeTurn
+// Description  : Waits until every response before a ticket has been read and
+//                takes the receive lock
+//
+// Inputs       : ticket - the ticket of the first response to read
+// Outputs      : none
+
+void takeTurn(uint64_t ticket) {
+
+	pthread_mutex_lock(&recvLock);
+	while (servingTicket != ticket) {
+		pthread_cond_wait(&recvTurn, &recvLock);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : finishTurn
+// Description  : Passes the turn to the next responses and releases the
+//                receive lock
+//
+// Inputs       : count - the number of responses that were read
+// Outputs      : none
+
+void finishTurn(int count) {
+
+	servingTicket += count;
+	pthread_cond_broadcast(&recvTurn);
+	pthread_mutex_unlock(&recvLock);
+}
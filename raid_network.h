@@ -29,4 +29,7 @@ extern unsigned short raid_network_port;     // Port of RAID server
 RAIDOpCode client_raid_bus_request(RAIDOpCode op, void *buf);
     // This is the implementation of the client operation (raid_client.c)
 
+int client_raid_bus_pipeline(RAIDOpCode *ops, int count);
+    // Sends several block-less requests before reading their responses (raid_client.c)
+
 #endif
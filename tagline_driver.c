@@ -11,9 +11,18 @@
 #include <cmpsc311_log.h>
 #include <cmpsc311_util.h>
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
 #include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
 
 // Project Includes
 #include "raid_bus.h"
@@ -39,18 +48,170 @@
 #define NUMBER_STATUS_BIT	1
 #define NUMBER_BLOCK_ID_BITS	32
 
-#define MAX_BLOCKS_CACHE	50
+#define EXTENT_CHUNK_SIZE	1024
+#define COALESCE_TIMEOUT_USEC	50000
+#define REBUILD_SLICE_BLOCKS	1024
+#define TAG_LOCK_SHARDS		16
+#define TAG_SHARD(tag)		((tag) % TAG_LOCK_SHARDS)
+#define ASYNC_WORKERS		8
+#define ASYNC_QUEUE_DEPTH	64
+#define READAHEAD_MIN_BLOCKS	8
+#define READAHEAD_MAX_BLOCKS	RAID_MAX_XFER
+#define READAHEAD_QUEUE_LIMIT	(ASYNC_QUEUE_DEPTH / 4)
+#define DEDUP_SIGNATURE_SIZE	20
+#define DEDUP_BUCKETS		65536
+#define DEDUP_MAX_REFS		UINT16_MAX
+#define COMPRESS_MAX_SIZE	(TAGLINE_BLOCK_SIZE / 2)
+#define COMPRESS_MIN_RUN	3
+#define COMPRESS_MAX_RUN	130
+#define COMPRESS_MAX_LITERAL	128
+#define SCRUB_INTERVAL_USEC	100000
+#define CRC32C_POLY		0x82f63b78
+#define CHECKSUMS_PER_RECORD	4
 
-// Structure for an entry in the allocation table
+#define JOURNAL_MAGIC		0x544c4a31
+#define JOURNAL_CHECKPOINT_RECORDS	65536
+
+#define DISK_BLOCKS		(MAX_TRACKS * RAID_TRACK_BLOCKS)
+#define BITMAP_WORD_BITS	64
+#define BITMAP_WORDS		((DISK_BLOCKS + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS)
+#define BITMAP_FULL_WORD	(~(uint64_t) 0)
+
+// Structure for an entry in the allocation table. Each entry is an extent that
+// maps contiguous tag blocks [taglineBlock, taglineBlock + contiguous) onto the
+// same number of contiguous blocks on the primary and backup disks. A packed
+// extent maps a single compressed tag block stored inside a block shared with
+// other packed blocks; packed is the offset of its data in that block plus one
+// (0 for blocks stored whole).
 typedef struct {
 	TagLineNumber tagline;
+	RAIDDiskID disk;
+	RAIDDiskID diskCopy;
 	TagLineBlockNumber taglineBlock;
 	int contiguous;
+	RAIDBlockID blockID;
+	RAIDBlockID blockIDCopy;
+	int packed;
+} tableinfo;
+
+// Structure for the write coalescing buffer, which holds one contiguous run of
+// blocks of a tag that has been accepted but not yet written to RAID
+typedef struct {
+	TagLineNumber tag;
+	TagLineBlockNumber start;
+	int blocks;
+	struct timeval staged;
+	char *buf;
+} pendingwrite;
+
+// Structure for one copy of a rebuild: blocks of the failed disk starting at
+// target are restored from the same number of blocks on the surviving disk
+typedef struct {
+	RAIDBlockID target;
+	RAIDDiskID source;
+	RAIDBlockID sourceBlock;
+	int blocks;
+} rebuildcopy;
+
+// Structure for one record of the allocation map journal. An extent record
+// holds the fields of a new extent; a header record holds the magic number and
+// the number of taglines, a max block record holds a tag and its block count,
+// a truncate record holds a tag and the number of blocks it was cut down to,
+// an unmap record holds a tag and a block taken out of its extent, a packed
+// record holds the fields of a packed extent with its offset plus one in place
+// of the block count, and a checksum record holds a tag, a block, a count and
+// the checksums of up to CHECKSUMS_PER_RECORD blocks from that block on.
+typedef struct {
+	uint32_t type;
+	uint32_t field[7];
+} journalrecord;
+
+// Types of journal records
+typedef enum {
+	JOURNAL_HEADER = 0,
+	JOURNAL_EXTENT = 1,
+	JOURNAL_MAXBLOCK = 2,
+	JOURNAL_TRUNCATE = 3,
+	JOURNAL_UNMAP = 4,
+	JOURNAL_PACKED = 5,
+	JOURNAL_CHECKSUM = 6
+} journaltype;
+
+// Types of asynchronous requests
+typedef enum {
+	ASYNC_READ = 0,
+	ASYNC_WRITE = 1,
+	ASYNC_PREFETCH = 2
+} asynctype;
+
+// Structure for a request submitted to the asynchronous interface
+typedef struct {
+	TagLineRequest id;
+	asynctype type;
+	TagLineNumber tag;
+	TagLineBlockNumber bnum;
+	uint8_t blks;
+	char *buf;
+	TagLineCallback done;
+	void *arg;
+} asyncrequest;
+
+// Structure for the sequential readahead state of a tag: the block a
+// sequential read would start at, the end of the blocks prefetched so far and
+// the number of blocks to keep prefetched ahead of the reader (0 if the tag is
+// not being read sequentially)
+typedef struct {
+	TagLineBlockNumber next;
+	TagLineBlockNumber prefetched;
+	int window;
+} readaheadstate;
+
+// Structure for one contiguous range of blocks of a vectored read or write on
+// a disk. The ranges of a batch are sorted by disk and block so physically
+// adjacent ranges go out as one RAID request; order keeps the sort stable. A
+// range that is cached once transferred holds the blocks of cacheTag starting
+// at cacheBlock.
+typedef struct {
 	RAIDDiskID disk;
 	RAIDBlockID blockID;
+	int blocks;
+	char *buf;
+	int cached;
+	TagLineNumber cacheTag;
+	TagLineBlockNumber cacheBlock;
+	int order;
+} vectorrange;
+
+// Structure for the plan of a vectored read or write: the ranges to transfer,
+// the new extents of a write to map once their blocks are stored, and a buffer
+// for gathering merged ranges
+typedef struct {
+	vectorrange *ranges;
+	int count, size;
+	tableinfo *added;
+	int addedCount, addedSize;
+	char *scratch;
+} vectorplan;
+
+// Structure for a block registered in the dedup index: the signature of its
+// contents, its primary and backup copies, and the next entry of its hash
+// bucket or of the free list (-1 at the end)
+typedef struct {
+	char signature[DEDUP_SIGNATURE_SIZE];
+	RAIDDiskID disk;
 	RAIDDiskID diskCopy;
+	RAIDBlockID blockID;
 	RAIDBlockID blockIDCopy;
-} tableinfo;
+	int next;
+} dedupentry;
+
+// Structure for the dedup state of a block on its primary disk: the number of
+// tag blocks mapped to it (or packed in it) and its entry in the dedup index
+// plus one (0 if it is not registered)
+typedef struct {
+	uint16_t refs;
+	int entry;
+} dedupblock;
 
 // More typedefs
 typedef enum {
@@ -58,11 +219,247 @@ typedef enum {
 	FALSE = 1
 } flag;
 
+// Function prototypes
+int allocateBlocks (RAIDDiskID firstDisk, RAIDDiskID excludeDisk, uint8_t blks,
+	RAIDDiskID *disk, RAIDBlockID *block);
+int findFreeBlocks (RAIDDiskID disk, uint8_t blks, RAIDBlockID *start);
+void markBlocks (RAIDDiskID disk, RAIDBlockID start, int blks, flag used);
+tableinfo *newExtent (void);
+tableinfo *getExtent (int entry);
+int writeBlocks (TagLineNumber tag, TagLineBlockNumber bnum, uint8_t blks, char *buf);
+int storeBlocks (TagLineNumber tag, TagLineBlockNumber bnum, RAIDDiskID disk, RAIDBlockID blockID,
+	RAIDDiskID diskCopy, RAIDBlockID blockIDCopy, int blks, char *buf);
+int writeCopies (RAIDDiskID disk, RAIDBlockID blockID, RAIDDiskID diskCopy,
+	RAIDBlockID blockIDCopy, int blks, char *buf);
+int flushPendingWrite (pendingwrite *run);
+void checkPendingWrite (pendingwrite *run);
+int takeFlushError (TagLineNumber tag);
+int tagLength (TagLineNumber tag);
+int growTag (TagLineNumber tag, TagLineBlockNumber end);
+int readTag (TagLineNumber tag, TagLineBlockNumber bnum, uint8_t blks, char *buf);
+int writeTag (TagLineNumber tag, TagLineBlockNumber bnum, uint8_t blks, char *buf);
+int readPinned (TagLineNumber tag, TagLineBlockNumber bnum, uint8_t blks, const char *blocks[]);
+void trackReadahead (TagLineNumber tag, TagLineBlockNumber bnum, uint8_t blks);
+int prefetchTag (TagLineNumber tag, TagLineBlockNumber bnum, uint8_t blks);
+int readAhead (TagLineNumber tag, TagLineBlockNumber bnum, uint8_t blks);
+int advanceRebuild (int maxBlocks);
+int handleDiskFailures (void);
+void selectReplica (tableinfo *entry, int offset, int blks, RAIDDiskID *disk,
+	RAIDBlockID *blockID);
+int indexExtent (tableinfo *entry);
+int planRebuild (RAIDDiskID diskFailed);
+int rebuildSlice (int maxBlocks);
+int isStale (RAIDDiskID disk, RAIDBlockID blockID, int blks);
+void markStale (RAIDBlockID blockID, int blks, flag stale);
+int compareRebuildCopies (const void *a, const void *b);
+RAIDOpCode packRaidOpcode (uint64_t requestType, uint64_t numBlocks, uint64_t diskNum,
+	uint64_t unused, uint64_t status, uint64_t blockID);
+int refreshDiskStates (void);
+int usableCopy (RAIDDiskID disk, RAIDBlockID blockID, int blks);
+int startDriver (uint32_t maxlines, flag warm);
+tableinfo *mapExtent (TagLineNumber tagNum, TagLineBlockNumber tagBlockNum, int blks,
+	RAIDDiskID disk, RAIDBlockID blockID, RAIDDiskID diskCopy, RAIDBlockID blockIDCopy);
+int journalAppend (journaltype type, uint32_t a, uint32_t b, uint32_t c, uint32_t d,
+	uint32_t e, uint32_t f, uint32_t g);
+int journalReplay (uint32_t maxlines);
+int journalCheckpoint (flag closing);
+int syncJournalDirectory (void);
+int trimTag (TagLineNumber tag, TagLineBlockNumber nblocks);
+void freeExtent (tableinfo *entry);
+void unindexExtent (tableinfo *entry);
+TagLineRequest submitRequest (asynctype type, TagLineNumber tag, TagLineBlockNumber bnum,
+	uint8_t blks, char *buf, TagLineCallback done, void *arg);
+void *asyncWorker (void *unused);
+int coalesceDue (struct timespec *deadline);
+void flushStaleWrites (void);
+int startWorkers (void);
+void stopWorkers (void);
+uint32_t lockVectors (TagLineVector *vec, int count);
+void unlockVectors (uint32_t shards);
+int readVectors (TagLineVector *vec, int count);
+int writeVectors (TagLineVector *vec, int count);
+int addVectorRange (vectorplan *plan, RAIDDiskID disk, RAIDBlockID blockID, int blocks,
+	char *buf, int cached, TagLineNumber cacheTag, TagLineBlockNumber cacheBlock);
+int addWriteRanges (vectorplan *plan, TagLineNumber tag, TagLineBlockNumber bnum, RAIDDiskID disk,
+	RAIDBlockID blockID, RAIDDiskID diskCopy, RAIDBlockID blockIDCopy, int blocks, char *buf);
+int runVectorPlan (vectorplan *plan, uint64_t requestType);
+int runWritePlan (vectorplan *plan);
+int compareVectorRanges (const void *a, const void *b);
+int dedupWrite (TagLineNumber tag, TagLineBlockNumber bnum, uint8_t blks, char *buf);
+int storeDedupRun (TagLineNumber tag, TagLineBlockNumber bnum, int blks, tableinfo *extent,
+	char *buf, char signatures[][DEDUP_SIGNATURE_SIZE]);
+int findDuplicate (const char *signature);
+void registerBlock (const char *signature, RAIDDiskID disk, RAIDBlockID blockID,
+	RAIDDiskID diskCopy, RAIDBlockID blockIDCopy);
+void unregisterBlock (RAIDDiskID disk, RAIDBlockID blockID);
+void referenceBlocks (RAIDDiskID disk, RAIDBlockID blockID, int blks);
+void releaseBlocks (RAIDDiskID disk, RAIDBlockID blockID, RAIDDiskID diskCopy,
+	RAIDBlockID blockIDCopy, int blks);
+void releaseDeferredBlocks (void);
+int unmapBlock (TagLineNumber tag, TagLineBlockNumber bnum);
+int writeWholeBlocks (TagLineNumber tag, TagLineBlockNumber bnum, uint8_t blks, char *buf);
+int compressWrite (TagLineNumber tag, TagLineBlockNumber bnum, uint8_t blks, char *buf);
+int storePackedRun (TagLineNumber tag, TagLineBlockNumber bnum, int blks, char *encoded,
+	int sizes[]);
+int allocateCopies (uint8_t blks, RAIDDiskID *disk, RAIDBlockID *blockID, RAIDDiskID *diskCopy,
+	RAIDBlockID *blockIDCopy);
+int compressBlock (const char *block, char *encoded);
+int decompressBlock (const char *packed, int offset, char *block);
+void *scrubWorker (void *unused);
+void startScrubber (void);
+void stopScrubber (void);
+int scrubSlice (int maxBlocks);
+int scrubExtent (tableinfo *entry, int offset, int blks);
+int repairFromCopy (tableinfo *entry, int offset, const char *primary, const char *copy);
+void initChecksums (void);
+uint32_t crc32cPortable (const char *data, int len);
+#if defined(__x86_64__)
+uint32_t crc32cHardware (const char *data, int len);
+#endif
+int checksumKnown (uint32_t slot);
+void setChecksums (TagLineNumber tag, TagLineBlockNumber bnum, int blks, const char *buf);
+int verifyBlocks (TagLineNumber tag, TagLineBlockNumber bnum, int blks, const char *buf);
+int failoverRead (tableinfo *entry, int offset, RAIDDiskID badDisk, char *raw, char *block);
+
 // Global variables
-int *maxBlockNumAllowed, hits, misses;
-tableinfo **raidtable;
+int *maxBlockNumAllowed;
+atomic_int hits, misses;
 char *failureBuf;
 
+// The allocation table is a pool of extents stored in fixed size chunks, so
+// entries never move once allocated and memory grows with the number of writes
+tableinfo **raidtable;
+int numChunks, numEntries;
+
+// Extents given back by delete and truncate, reused before the pool grows
+tableinfo **freeExtents;
+int numFreeExtents, freeExtentsSize;
+
+// Directory of allocation table entries indexed directly by tag and tag block
+// number (tag * MAX_TAGLINE_BLOCK_NUMBER + block), so lookups are constant time
+tableinfo **tagDirectory;
+uint32_t maxTaglines;
+
+// Write coalescing buffers, one per tag lock shard so a run is only ever
+// flushed by a thread holding the lock of its tag
+pendingwrite pending[TAG_LOCK_SHARDS];
+
+// Tags whose coalesced blocks could not be written out at some point, set
+// until the error is reported to a read or write of the tag or the blocks are
+// truncated away. The blocks stay staged until a later attempt writes them.
+// Guarded by the tag's lock.
+int *flushFailed;
+
+// Locking. Each tag's blocks, directory slots, block count and coalescing
+// buffer are guarded by the lock of its shard. Requests hold the rebuild lock
+// for reading while they do I/O; a rebuild slice, a disk failure or a truncate
+// holds it for writing. The map lock guards the allocator, the extent pool,
+// the reverse index and the journal. Locks are taken in that order.
+pthread_mutex_t tagLocks[TAG_LOCK_SHARDS];
+
+// Sequential readahead state of every tag, guarded by the tag's lock
+readaheadstate *readahead;
+pthread_rwlock_t rebuildLock = PTHREAD_RWLOCK_INITIALIZER;
+pthread_mutex_t mapLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Per-disk occupancy bitmaps (a set bit is an allocated RAID block) and the
+// next-fit cursor (in bitmap words) used to start each disk's free space search
+uint64_t diskBitmap[NUM_DISKS][BITMAP_WORDS];
+int diskCursor[NUM_DISKS];
+
+// Read replica selection state: the last track each disk was accessed on, the
+// number of blocks read from each disk, and the round-robin tie breaker
+atomic_int diskLastTrack[NUM_DISKS];
+atomic_uint_fast64_t diskReadBlocks[NUM_DISKS];
+atomic_int replicaTurn;
+
+// Reverse index listing the extents that have a copy on each disk, so a rebuild
+// only visits the extents of the failed disk
+tableinfo **diskExtents[NUM_DISKS];
+int diskExtentCount[NUM_DISKS], diskExtentSize[NUM_DISKS];
+
+// Last known state of every disk (RAID_DISK_STATE), refreshed with one
+// pipelined round of STATUS requests when a failure is signalled or a request fails
+atomic_int diskState[NUM_DISKS];
+
+// Background rebuild state: the disk being rebuilt (-1 if none), its sorted
+// copy plan and the cursor of the next copy, and a bitmap of its blocks that
+// do not hold current data yet (stale blocks are only read from the other copy)
+atomic_int rebuildTarget;
+rebuildcopy *rebuildPlan;
+int rebuildCount, rebuildCursor;
+uint64_t staleBitmap[BITMAP_WORDS];
+
+// Allocation map journal (TAGLINE_JOURNAL_FILE), appended to as extents are
+// created and rewritten as a compact checkpoint once it holds
+// JOURNAL_CHECKPOINT_RECORDS records. Records are flushed to the file as they
+// are appended; each checkpoint is also synced to the disk, with the
+// directory entry that renames it into place.
+FILE *journal;
+int journalRecords;
+
+// Asynchronous requests: a ring of submitted requests served by a pool of
+// worker threads that call tagline_read/tagline_write, and a ring of finished
+// requests without a callback waiting to be reaped. Requests that are queued,
+// running or waiting to be reaped are limited to ASYNC_QUEUE_DEPTH, so neither
+// ring can overflow. The workers also write out the coalesced runs that time
+// out; coalesceSwept is when they last looked. All of it is guarded by the
+// async lock.
+asyncrequest asyncQueue[ASYNC_QUEUE_DEPTH];
+TagLineCompletion asyncDone[ASYNC_QUEUE_DEPTH];
+int asyncHead, asyncQueued, asyncRunning, doneHead, doneCount, asyncWorkerCount;
+TagLineRequest nextRequest;
+flag asyncStopping;
+struct timeval coalesceSwept;
+pthread_t asyncWorkers[ASYNC_WORKERS];
+pthread_mutex_t asyncLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t asyncSubmitted = PTHREAD_COND_INITIALIZER;
+pthread_cond_t asyncFinished = PTHREAD_COND_INITIALIZER;
+
+// Block deduplication (TAGLINE_DEDUP): the reference count and index entry of
+// every block by its primary copy, a hash table of the signatures of
+// registered blocks over a growable pool of entries, and the blocks freed
+// while a rebuild is in progress, which are only given back to the allocator
+// once it is done. Guarded by the map lock. The signature lock serializes
+// generate_md5_signature, which keeps its digest state in a global.
+dedupblock *dedupBlocks;
+int dedupBuckets[DEDUP_BUCKETS];
+dedupentry *dedupEntries;
+int dedupCount, dedupSize, dedupFree;
+uint64_t deferredBitmap[NUM_DISKS][BITMAP_WORDS];
+atomic_int dedupShared, dedupSkipped;
+pthread_mutex_t signatureLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Block compression (TAGLINE_COMPRESS): the number of tag blocks packed and of
+// blocks they were packed into. Packed blocks share the reference counts of
+// deduplication, one reference per tag block packed in a block.
+atomic_int packedBlocks, packBlocksUsed;
+
+// Mirror scrubbing (TAGLINE_SCRUB_RATE): the scrubber thread, the tag and
+// block it goes on from, its buffers for the two copies of an extent, and the
+// number of blocks verified and repaired. The cursor and the buffers are only
+// used by the thread; the scrub lock guards stopping it.
+pthread_t scrubThread;
+flag scrubRunning, scrubStopping;
+TagLineNumber scrubTag;
+TagLineBlockNumber scrubBlock;
+char *scrubBuf, *scrubCopyBuf;
+atomic_int scrubVerified, scrubRepaired;
+pthread_mutex_t scrubLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t scrubWake = PTHREAD_COND_INITIALIZER;
+
+// Block checksums (TAGLINE_CHECKSUM): the CRC32C of every tag block, indexed
+// like the tag directory, a bitmap of the blocks whose checksum is known, the
+// CRC32C function in use with the lookup table of the portable one, and the
+// number of blocks read that failed their checksum (or, if packed, could not be
+// decompressed). The checksums of a tag fill whole bitmap words, so they are
+// guarded by the tag's lock.
+uint32_t *blockChecksums;
+uint64_t *checksumBitmap;
+uint32_t (*crc32c) (const char *data, int len);
+uint32_t crc32cTable[256];
+atomic_int checksumFailures;
+
 //
 // Functions
 
@@ -75,6 +472,35 @@ char *failureBuf;
 // Outputs      : 0 if successful, -1 if failure
 
 int tagline_driver_init(uint32_t maxlines) {
+	return startDriver(maxlines, FALSE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagline_driver_restart
+// Description  : Initialize the driver from the journal of a previous run,
+//                keeping the data on the disks instead of formatting them. If
+//                there is no usable journal the disks are formatted as in init.
+//
+// Inputs       : maxlines - the maximum number of tag lines in the system
+// Outputs      : 0 if successful, -1 if failure
+
+int tagline_driver_restart(uint32_t maxlines) {
+	return startDriver(maxlines, TRUE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : startDriver
+// Description  : Sets up the driver state and the disks, either formatting the
+//                disks and starting a new journal (cold) or replaying the
+//                journal of the previous run (warm)
+//
+// Inputs       : maxlines - the maximum number of tag lines in the system
+//                warm - TRUE to restore the previous run from the journal
+// Outputs      : 0 if successful, -1 if failure
+
+int startDriver(uint32_t maxlines, flag warm) {
 
 	// Declares local variables
 	RAIDOpCode response;
@@ -104,14 +530,121 @@ int tagline_driver_init(uint32_t maxlines) {
 		return (-1);
 	}
 
-	// Allocates memory to store an array of allocation table entry addresses (GLOBAL VARIABLE).
-	// One extra element is added so the last entry is always designated to be NULL.
-	raidtable = (tableinfo **) calloc((MAX_TAGLINE_BLOCK_NUMBER * maxlines) + 1, sizeof(tableinfo));
-	
-	if (!raidtable) {
+	// Allocates memory to the coalesced write errors of every tag; no write
+	// has failed yet (GLOBAL VARIABLE)
+	flushFailed = (int *) calloc(maxlines, sizeof(int));
+
+	if (!flushFailed) {
+		logMessage(LOG_ERROR_LEVEL, "Memory allocation failed. Bye bye!");
+		return (-1);
+	}
+
+	// The allocation table starts empty; chunks of extents are added as needed (GLOBAL VARIABLE)
+	raidtable = NULL;
+	numChunks = 0;
+	freeExtents = NULL;
+	numFreeExtents = 0;
+	freeExtentsSize = 0;
+
+	// Allocates memory to the tag directory, one slot per possible tag block (GLOBAL VARIABLE)
+	tagDirectory = (tableinfo **) calloc(MAX_TAGLINE_BLOCK_NUMBER * maxlines, sizeof(tableinfo *));
+
+	if (!tagDirectory) {
+		logMessage(LOG_ERROR_LEVEL, "Memory allocation failed. Bye bye!");
+		return (-1);
+	}
+	maxTaglines = maxlines;
+	numEntries = 0;
+
+	// Allocates memory to the readahead state of every tag; no tag is being
+	// read sequentially yet (GLOBAL VARIABLE)
+	readahead = (readaheadstate *) calloc(maxlines, sizeof(readaheadstate));
+
+	if (!readahead) {
 		logMessage(LOG_ERROR_LEVEL, "Memory allocation failed. Bye bye!");
 		return (-1);
 	}
+	for (i = 0; i < (int) maxlines; i++) {
+		readahead[i].next = MAX_TAGLINE_BLOCK_NUMBER;
+	}
+
+	// Clears the occupancy bitmaps and marks the bits past the end of each disk as used
+	memset(diskBitmap, 0, sizeof(diskBitmap));
+	memset(diskCursor, 0, sizeof(diskCursor));
+	for (i = 0; i < NUM_DISKS; i++) {
+		markBlocks(i, DISK_BLOCKS, (BITMAP_WORDS * BITMAP_WORD_BITS) - DISK_BLOCKS, TRUE);
+	}
+
+	// Clears the read replica selection state
+	for (i = 0; i < NUM_DISKS; i++) {
+		diskLastTrack[i] = -1;
+		diskReadBlocks[i] = 0;
+	}
+	replicaTurn = 0;
+
+	// The reverse index starts empty; each disk's list grows as extents are added
+	for (i = 0; i < NUM_DISKS; i++) {
+		diskExtents[i] = NULL;
+		diskExtentCount[i] = 0;
+		diskExtentSize[i] = 0;
+	}
+
+	// No disk is being rebuilt
+	rebuildTarget = -1;
+	rebuildPlan = NULL;
+	rebuildCount = 0;
+	rebuildCursor = 0;
+	memset(staleBitmap, 0, sizeof(staleBitmap));
+
+	// Allocates memory to the dedup state of every block and empties the dedup
+	// index (GLOBAL VARIABLE)
+	if (TAGLINE_DEDUP || TAGLINE_COMPRESS) {
+		dedupBlocks = (dedupblock *) calloc(NUM_DISKS * DISK_BLOCKS, sizeof(dedupblock));
+
+		if (!dedupBlocks) {
+			logMessage(LOG_ERROR_LEVEL, "Memory allocation failed. Bye bye!");
+			return (-1);
+		}
+	}
+	for (i = 0; i < DEDUP_BUCKETS; i++) {
+		dedupBuckets[i] = -1;
+	}
+	dedupEntries = NULL;
+	dedupCount = 0;
+	dedupSize = 0;
+	dedupFree = -1;
+	memset(deferredBitmap, 0, sizeof(deferredBitmap));
+	dedupShared = 0;
+	dedupSkipped = 0;
+	packedBlocks = 0;
+	packBlocksUsed = 0;
+
+	// Allocates memory to the checksum of every tag block, none of them known
+	// yet (GLOBAL VARIABLE)
+	if (TAGLINE_CHECKSUM) {
+		blockChecksums = (uint32_t *) calloc(MAX_TAGLINE_BLOCK_NUMBER * maxlines, sizeof(uint32_t));
+		checksumBitmap = (uint64_t *) calloc((MAX_TAGLINE_BLOCK_NUMBER * maxlines) / BITMAP_WORD_BITS,
+			sizeof(uint64_t));
+
+		if (!blockChecksums || !checksumBitmap) {
+			logMessage(LOG_ERROR_LEVEL, "Memory allocation failed. Bye bye!");
+			return (-1);
+		}
+	}
+	initChecksums();
+
+	// Allocates memory to the write coalescing buffers, one maximal transfer long,
+	// and initializes the tag locks (GLOBAL VARIABLE)
+	for (i = 0; i < TAG_LOCK_SHARDS; i++) {
+		pending[i].buf = malloc(RAID_MAX_XFER * RAID_BLOCK_SIZE);
+		pending[i].blocks = 0;
+
+		if (!pending[i].buf) {
+			logMessage(LOG_ERROR_LEVEL, "Memory allocation failed. Bye bye!");
+			return (-1);
+		}
+		pthread_mutex_init(&tagLocks[i], NULL);
+	}
 
 	// Allocates memory to the buffer that will be used in the RAID signal method (GLOBAL VARIBLE)
 	failureBuf = malloc(RAID_MAX_XFER * RAID_BLOCK_SIZE);
@@ -121,8 +654,34 @@ int tagline_driver_init(uint32_t maxlines) {
 		return (-1);
 	}
 
+	// Initializes the cache before the journal is replayed, which drops freed blocks from it
+	if (init_raid_cache((uint32_t) TAGLINE_CACHE_SIZE, TAGLINE_CACHE_POLICY) == -1) {
+		logMessage(LOG_ERROR_LEVEL, "Cache could not be initialized. Bye bye!");
+		return (-1);
+	}
+	set_raid_cache_write_back(TAGLINE_CACHE_WRITE_BACK);
+
+	// Restores the allocation map of the previous run, which leaves the disks as
+	// they are. This needs the disks to have kept their contents, i.e. to be
+	// formatted already; a failed disk is rebuilt when its failure is signalled.
+	if (warm == TRUE) {
+		if (refreshDiskStates() == -1) {
+			logMessage(LOG_ERROR_LEVEL, "A RAID command failed. Bye bye!");
+			return (-1);
+		}
+		for (i = 0; i < NUM_DISKS && diskState[i] != RAID_DISK_UNINITIALIZED; i++);
+
+		if (i == NUM_DISKS && journalReplay(maxlines) == 0) {
+			logMessage(LOG_INFO_LEVEL, "TAGLINE: replayed %d extents from the journal", numEntries);
+		}
+		else {
+			logMessage(LOG_WARNING_LEVEL, "TAGLINE: no usable journal or disks, formatting the disks");
+			warm = FALSE;
+		}
+	}
+
 	// Formats the disks. First disk number is 0.
-	for (i = 0; i < NUM_DISKS; i++) {
+	for (i = 0; warm == FALSE && i < NUM_DISKS; i++) {
 		response = create_raid_request (RAID_FORMAT, 0, i, 0, 0, 0, NULL);
 
 		// Checks if the RAID command executed successfully
@@ -131,15 +690,29 @@ int tagline_driver_init(uint32_t maxlines) {
 			logMessage(LOG_INFO_LEVEL, "A RAID command failed. Bye bye!");
 			return (-1);
 		}
+		diskState[i] = RAID_DISK_READY;
 	}
 
-	// Initializes the cache
-	init_raid_cache((uint32_t) MAX_BLOCKS_CACHE);
+	// Starts the journal over with a checkpoint of the current (possibly empty) map
+	journal = NULL;
+	if (journalCheckpoint(FALSE) == -1) {
+		logMessage(LOG_ERROR_LEVEL, "The journal could not be written. Bye bye!");
+		return (-1);
+	}
 
 	// Initializes cache statistics
 	hits = 0;
 	misses = 0;
 
+	// Starts the threads that serve submitted requests
+	if (startWorkers() == -1) {
+		logMessage(LOG_ERROR_LEVEL, "Request threads could not be started. Bye bye!");
+		return (-1);
+	}
+
+	// Starts verifying the mirrors in the background
+	startScrubber();
+
 	// Return successfully
 	logMessage(LOG_INFO_LEVEL, "TAGLINE: initialized storage (maxline=%u)", maxlines);
 	return(0);
@@ -158,48 +731,160 @@ int tagline_driver_init(uint32_t maxlines) {
 
 int tagline_read(TagLineNumber tag, TagLineBlockNumber bnum, uint8_t blks, char *buf) {
 
-	// Makes sure the blocks being read does not pass the max block number
-	if (bnum + blks > maxBlockNumAllowed[tag]){
+	// Declares local variables
+	int result;
+
+	if (tag >= maxTaglines) {
+		return (-1);
+	}
+
+	// Reads under the tag's lock, then advances any disk rebuild in progress
+	pthread_mutex_lock(&tagLocks[TAG_SHARD(tag)]);
+	pthread_rwlock_rdlock(&rebuildLock);
+	result = readTag(tag, bnum, blks, buf);
+	pthread_rwlock_unlock(&rebuildLock);
+
+	if (result == 0) {
+		trackReadahead(tag, bnum, blks);
+		result = advanceRebuild(REBUILD_SLICE_BLOCKS);
+	}
+	pthread_mutex_unlock(&tagLocks[TAG_SHARD(tag)]);
+
+	return (result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : readTag
+// Description  : Reads a number of blocks of a tag. Called with the tag's lock
+//                held and the rebuild lock held for reading.
+//
+// Inputs       : tag - the number of the tagline to read from
+//                bnum - the starting block to read from
+//                blks - the number of blocks to read
+//                buf - memory block to read the blocks into
+// Outputs      : 0 if successful, -1 if failure
+
+int readTag(TagLineNumber tag, TagLineBlockNumber bnum, uint8_t blks, char *buf) {
+
+	// Makes sure the tag exists and the blocks being read does not pass the max block number
+	if (tag >= maxTaglines || bnum + blks > tagLength(tag)){
 		return (-1);
 	}
 
 	// Declares local variables
 	tableinfo *temp;
 	RAIDOpCode response;
-	int blksRead = 0, *cacheTemp, reading;
+	RAIDDiskID readDisk;
+	RAIDBlockID readBlock;
+	int blksRead = 0, reading, offset, damaged, i, j, k;
 	int arr[RAID_OPCODE_MAXVAL] = {0};
+	char missed[RAID_MAX_XFER], packedBlock[TAGLINE_BLOCK_SIZE], *dest, *raw;
+	pendingwrite *run = &pending[TAG_SHARD(tag)];
+
+	// Writes out coalesced blocks that have waited too long, or that this
+	// read needs (read-after-write), then reports any that could not be
+	// written for this tag
+	checkPendingWrite(run);
+	if (run->blocks > 0 && run->tag == tag && bnum < run->start + run->blocks
+			&& bnum + blks > run->start) {
+		flushPendingWrite(run);
+	}
+	if (takeFlushError(tag) == -1) {
+		return (-1);
+	}
 
 	// Reads tagline info by sets of contiguous blocks in RAID.
 	while (blksRead < blks) {
-		// Obtains the address of the tag entry
+		// Obtains the address of the extent holding the tag block
 		if ((temp = getTagEntry(tag, bnum + blksRead)) == NULL) {
 			logMessage(LOG_ERROR_LEVEL, "Tag entry does not exist. Bye bye!");
 			return (-1);
 		}
 
-		// Determines the amount of contiguous blocks needed to read
-		if (temp->contiguous > blks - blksRead) reading = blks - blksRead; else reading = temp->contiguous;
+		// Determines where the block sits in the extent and the amount of
+		// contiguous blocks needed to read from it
+		offset = bnum + blksRead - temp->taglineBlock;
+		reading = temp->contiguous - offset;
+		if (reading > blks - blksRead) reading = blks - blksRead;
+		dest = &buf[blksRead * TAGLINE_BLOCK_SIZE];
 
-		// Reads from the cache if applicable
-		if ((cacheTemp = (int *) get_raid_cache(temp->disk, temp->blockID)) != NULL) {
-			hits++;
-			memcpy(&buf[blksRead * TAGLINE_BLOCK_SIZE], cacheTemp, reading * TAGLINE_BLOCK_SIZE);
+		// Serves every cached block of the set from memory and notes the
+		// blocks that miss
+		for (i = 0; i < reading; i++) {
+			if (copy_raid_cache(tag, bnum + blksRead + i, &dest[i * TAGLINE_BLOCK_SIZE]) == 0) {
+				hits++;
+				missed[i] = 0;
+			}
+			else {
+				misses++;
+				missed[i] = 1;
+			}
 		}
 
-		// Reads from RAID otherwise and inserts data into cache
-		else {
-			misses++;
+		// Reads each run of missed blocks from RAID with a single request to
+		// whichever copy is cheaper to read. A packed block is read through
+		// the block it is packed in.
+		for (i = 0; i < reading; i = j + 1) {
+			for (j = i; j < reading && missed[j]; j++);
+			if (j == i) continue;
+
+			raw = temp->packed ? packedBlock : &dest[i * TAGLINE_BLOCK_SIZE];
+			selectReplica(temp, offset + i, j - i, &readDisk, &readBlock);
 			response = create_raid_request
-				(RAID_READ, reading, temp->disk, 0, 0, 
-				temp->blockID, &buf[blksRead * TAGLINE_BLOCK_SIZE]);
-			put_raid_cache(temp->disk, temp->blockID, buf);
+				(RAID_READ, j - i, readDisk, 0, 0, 
+				readBlock, raw);
+			extract_raid_response(response, arr, RAID_OPCODE_MAXVAL);
+
+			// Retries once on the other copy if the disk turns out to have failed
+			if (arr[RAID_OPCODE_STATUS] == 1 && refreshDiskStates() == 0
+					&& diskState[readDisk] == RAID_DISK_FAILED) {
+				selectReplica(temp, offset + i, j - i, &readDisk, &readBlock);
+				response = create_raid_request
+					(RAID_READ, j - i, readDisk, 0, 0, 
+					readBlock, raw);
+				extract_raid_response(response, arr, RAID_OPCODE_MAXVAL);
+			}
 
 			// Checks if the RAID command executed successfully
-			extract_raid_response(response, arr, RAID_OPCODE_MAXVAL);
 			if (arr[RAID_OPCODE_STATUS] == 1) {
 				logMessage(LOG_ERROR_LEVEL, "A RAID command failed. Bye bye!");
 				return (-1);
 			}
+
+			// Reads each block that fails its checksum from the other copy
+			for (k = i; TAGLINE_CHECKSUM && !temp->packed && k < j; k++) {
+				if (verifyBlocks(tag, bnum + blksRead + k, 1, &dest[k * TAGLINE_BLOCK_SIZE]) == -1
+						&& failoverRead(temp, offset + k, readDisk, &dest[k * TAGLINE_BLOCK_SIZE],
+						&dest[k * TAGLINE_BLOCK_SIZE]) == -1) {
+					return (-1);
+				}
+			}
+		}
+
+		// Decompresses a missed packed block into place. One that is damaged or
+		// fails its checksum is read from a copy that passes.
+		if (temp->packed && missed[0]) {
+			damaged = (decompressBlock(packedBlock, temp->packed - 1, dest) == -1);
+			if (damaged && TAGLINE_CHECKSUM) {
+				checksumFailures++;
+			}
+			if (damaged || (TAGLINE_CHECKSUM && verifyBlocks(tag, bnum + blksRead, 1, dest) == -1)) {
+				if (!TAGLINE_CHECKSUM || failoverRead(temp, offset, readDisk, packedBlock, dest) == -1) {
+					logMessage(LOG_ERROR_LEVEL, "A packed block is damaged. Bye bye!");
+					return (-1);
+				}
+			}
+		}
+
+		// Inserts the runs of missed blocks into the cache only once the buffer is
+		// complete, as each insert may evict (and write back) another block of the set
+		for (i = 0; i < reading; i = j + 1) {
+			for (j = i; j < reading && missed[j]; j++);
+			if (j > i) {
+				put_raid_cache_blocks(tag, bnum + blksRead + i, j - i,
+					&dest[i * TAGLINE_BLOCK_SIZE]);
+			}
 		}
 
 		// Increases the number of block read
@@ -214,505 +899,4583 @@ int tagline_read(TagLineNumber tag, TagLineBlockNumber bnum, uint8_t blks, char
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : tagline_write
-// Description  : Write a number of blocks from the tagline driver
+// Function     : tagline_read_pinned
+// Description  : Reads a number of blocks without copying them out of the
+//                cache. Each block is returned as a pointer to its cache slot,
+//                which is pinned: it is neither evicted nor changed until it is
+//                released with tagline_release, so it keeps showing the data as
+//                of the read. Blocks that miss are read into the cache first.
 //
-// Inputs       : tag - the number of the tagline to write from
-//                bnum - the starting block to write from
-//                blks - the number of blocks to write
-//                buf - the place to write the blocks into
-// Outputs      : 0 if successful, -1 if failure
+// Inputs       : tag - the number of the tagline to read from
+//                bnum - the starting block to read from
+//                blks - the number of blocks to read
+//                blocks - set to a pointer to each block read
+// Outputs      : 0 if successful, -1 if failure (nothing stays pinned)
 
-int tagline_write(TagLineNumber tag, TagLineBlockNumber bnum, uint8_t blks, char *buf) {
+int tagline_read_pinned(TagLineNumber tag, TagLineBlockNumber bnum, uint8_t blks,
+		const char *blocks[]) {
 
-	// Makes sure the starting block number does not exceed the max block number
-	if (bnum > maxBlockNumAllowed[tag]) {
+	// Declares local variables
+	int result;
+
+	if (tag >= maxTaglines) {
 		return (-1);
 	}
 
-	// Declares local variables
-	int blksRead = 0, maxBlockNum, result, overwriteNum;
-	RAIDOpCode response, responsetwo;
-	tableinfo *temp;
-	int arr[RAID_OPCODE_MAXVAL] = {0};
-	int arrtwo[RAID_OPCODE_MAXVAL] = {0};
-
-	// Extracts the max block number that can be written to the tag
-	maxBlockNum = maxBlockNumAllowed[tag];
+	// Reads under the tag's lock, then advances any disk rebuild in progress
+	pthread_mutex_lock(&tagLocks[TAG_SHARD(tag)]);
+	pthread_rwlock_rdlock(&rebuildLock);
+	result = readPinned(tag, bnum, blks, blocks);
+	pthread_rwlock_unlock(&rebuildLock);
 
-	// Determines the amount of blocks to overwrite, assuming that an overwrite will occur
-	overwriteNum = blks;
-	if (bnum + blks > maxBlockNum) {
-		overwriteNum = maxBlockNum - bnum;
+	if (result == 0) {
+		trackReadahead(tag, bnum, blks);
 	}
+	if (result == 0 && advanceRebuild(REBUILD_SLICE_BLOCKS) == -1) {
+		tagline_release(blocks, blks);
+		result = -1;
+	}
+	pthread_mutex_unlock(&tagLocks[TAG_SHARD(tag)]);
 
-	// Overwrite existing tagline blocks and insert remaining new blocks
-	// if a given tag entry already exists.
-	if (getTagEntry(tag, bnum) != NULL) {
-		// Overwrite blocks by sets of contiguous blocks in RAID
-		while (blksRead < overwriteNum) {
-			// Overwrite exisiting blocks by contiguous sets
-			temp = (tableinfo *) getTagEntry(tag, bnum + blksRead);
-			response = create_raid_request
-				(RAID_WRITE, temp->contiguous, temp->disk, 0, 0, 
-				temp->blockID, &buf[blksRead * TAGLINE_BLOCK_SIZE]);
-			responsetwo = create_raid_request
-				(RAID_WRITE, temp->contiguous, temp->diskCopy, 0, 0, 
-				temp->blockIDCopy, &buf[blksRead * TAGLINE_BLOCK_SIZE]);
-
-			// Checks if RAID disk and block exists in cache
-			if (get_raid_cache(temp->disk, temp->blockID) == NULL) misses++; else hits++;
-			put_raid_cache(temp->disk, temp->blockID, &buf[blksRead * TAGLINE_BLOCK_SIZE]);
+	return (result);
+}
 
-			if (get_raid_cache(temp->diskCopy, temp->blockIDCopy) == NULL) misses++; else hits++;
-			put_raid_cache(temp->diskCopy, temp->blockIDCopy, &buf[blksRead * TAGLINE_BLOCK_SIZE]);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagline_release
+// Description  : Releases blocks returned by tagline_read_pinned
+//
+// Inputs       : blocks - the pointers to the blocks, cleared on return
+//                blks - the number of blocks
+// Outputs      : none
 
-			// Checks if the RAID commands executed successfully
-			extract_raid_response(response, arr, RAID_OPCODE_MAXVAL);
-			extract_raid_response(responsetwo, arrtwo, RAID_OPCODE_MAXVAL);
-			if (arr[RAID_OPCODE_STATUS] == 1 || arrtwo[RAID_OPCODE_STATUS] == 1) {
-				logMessage(LOG_ERROR_LEVEL, "A RAID command failed. Bye bye!");
-				return (-1);
-			}
+void tagline_release(const char *blocks[], uint8_t blks) {
 
-			// Increases the amount of blocks overwritten
-			blksRead += temp->contiguous;
-		}
+	// Declares local variables
+	int i;
 
-		// Inserts new blocks if necessary
-		if (blksRead < blks) {
-			result = insertEntry(tag, maxBlockNum, bnum + blks - maxBlockNum
-					, &buf[blksRead * TAGLINE_BLOCK_SIZE]);
+	for (i = 0; i < blks; i++) {
+		if (blocks[i] != NULL) {
+			unpin_raid_cache(blocks[i]);
+			blocks[i] = NULL;
 		}
 	}
+}
 
-	// Inserts into a new set of contiguous blocks otherwise
-	else {
-		result = insertEntry(tag, bnum, blks, buf);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : readPinned
+// Description  : Pins a number of blocks of a tag in the cache. Called with
+//                the tag's lock held and the rebuild lock held for reading.
+//
+// Inputs       : tag - the number of the tagline to read from
+//                bnum - the starting block to read from
+//                blks - the number of blocks to read
+//                blocks - set to a pointer to each block read
+// Outputs      : 0 if successful, -1 if failure
+
+int readPinned (TagLineNumber tag, TagLineBlockNumber bnum, uint8_t blks, const char *blocks[]) {
+
+	// Declares local variables
+	pendingwrite *run = &pending[TAG_SHARD(tag)];
+	char *scratch = NULL;
+	int i, j, k;
+
+	// Makes sure the tag exists and the blocks being read does not pass the max block number
+	if (bnum + blks > tagLength(tag)) {
+		return (-1);
 	}
 
-	// Checks if the insertEntry method succeeded
-	if (result == -1) {
-		logMessage(LOG_ERROR_LEVEL, "Insert has failed. Bye bye!");
+	// Writes out coalesced blocks that have waited too long, or that this
+	// read needs (read-after-write), then reports any that could not be
+	// written for this tag
+	checkPendingWrite(run);
+	if (run->blocks > 0 && run->tag == tag && bnum < run->start + run->blocks
+			&& bnum + blks > run->start) {
+		flushPendingWrite(run);
+	}
+	if (takeFlushError(tag) == -1) {
 		return (-1);
 	}
 
-	// Increases the max block number if necessary
-	if (bnum + blks > maxBlockNum) {
-		maxBlockNumAllowed[tag] = bnum + blks;
+	// Pins every cached block
+	for (i = 0; i < blks; i++) {
+		if (getTagEntry(tag, bnum + i) == NULL) {
+			logMessage(LOG_ERROR_LEVEL, "Tag entry does not exist. Bye bye!");
+			for (blocks[i] = NULL; i < blks; i++) blocks[i] = NULL;
+			tagline_release(blocks, blks);
+			return (-1);
+		}
+		blocks[i] = pin_raid_cache(tag, bnum + i, NULL);
+		if (blocks[i] != NULL) {
+			hits++;
+		}
+	}
+
+	// Reads each run of missed blocks through the copying read path, then
+	// pins them, caching the copy read if they have been evicted again
+	// meanwhile
+	for (i = 0; i < blks; i = j) {
+		if (blocks[i] != NULL) {
+			j = i + 1;
+			continue;
+		}
+		for (j = i; j < blks && blocks[j] == NULL; j++);
+
+		if (scratch == NULL && (scratch = malloc(RAID_MAX_XFER * TAGLINE_BLOCK_SIZE)) == NULL) {
+			logMessage(LOG_ERROR_LEVEL, "Memory allocation failed.");
+			tagline_release(blocks, blks);
+			return (-1);
+		}
+		if (readTag(tag, bnum + i, j - i, scratch) == -1) {
+			free(scratch);
+			tagline_release(blocks, blks);
+			return (-1);
+		}
+		for (k = i; k < j; k++) {
+			blocks[k] = pin_raid_cache(tag, bnum + k, &scratch[(k - i) * TAGLINE_BLOCK_SIZE]);
+			if (blocks[k] == NULL) {
+				logMessage(LOG_ERROR_LEVEL, "Too many cache blocks are pinned.");
+				free(scratch);
+				tagline_release(blocks, blks);
+				return (-1);
+			}
+		}
 	}
+	free(scratch);
 
 	// Return successfully
-	logMessage(LOG_INFO_LEVEL, "TAGLINE : wrote %u blocks to tagline %u, starting block %u.",
+	logMessage(LOG_INFO_LEVEL, "TAGLINE : pinned %u blocks of tagline %u, starting block %u.",
 			blks, tag, bnum);
-	return(0);
+	return (0);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : tagline_close
-// Description  : Close the tagline interface
+// Function     : trackReadahead
+// Description  : Follows the reads of a tag to spot sequential scans. A read
+//                that starts where the previous one ended continues a scan;
+//                once fewer than half a window of prefetched blocks are left
+//                ahead of it, the next blocks up to a window ahead are
+//                prefetched into the cache by a request thread, unless the
+//                request queue is busy, in which case a later read tries
+//                again. The window starts at READAHEAD_MIN_BLOCKS and
+//                doubles, up to a maximal transfer, whenever the scan reads
+//                blocks prefetched for it.
+//                Any other read ends the scan. Called with the tag's lock held.
 //
-// Inputs       : none
-// Outputs      : 0 if successful, -1 if failure
+// Inputs       : tag - the tag read
+//                bnum - the first block read
+//                blks - the number of blocks read
+// Outputs      : none
 
-int tagline_close(void) {
+void trackReadahead (TagLineNumber tag, TagLineBlockNumber bnum, uint8_t blks) {
 
 	// Declares local variables
-	RAIDOpCode response;
-	int arr[RAID_OPCODE_MAXVAL] = {0};
-	int i;
+	readaheadstate *ra = &readahead[tag];
+	TagLineBlockNumber end;
 
-	// Frees the allocated pointers
-	free(failureBuf);
-	failureBuf = NULL;
+	// Any read that does not continue the scan resets the window
+	if (bnum != ra->next) {
+		ra->next = bnum + blks;
+		ra->prefetched = 0;
+		ra->window = 0;
+		return;
+	}
+	ra->next = bnum + blks;
+
+	// Waits until the reader comes within half a window of the prefetched blocks
+	if (ra->window > 0 && ra->prefetched > ra->next && ra->prefetched - ra->next >= ra->window / 2) {
+		return;
+	}
+
+	// Opens the window, or widens it if the scan has been reading prefetched blocks
+	if (ra->window == 0) {
+		ra->window = READAHEAD_MIN_BLOCKS;
+	}
+	else if (bnum < ra->prefetched) {
+		ra->window = (ra->window * 2 > READAHEAD_MAX_BLOCKS) ? READAHEAD_MAX_BLOCKS : ra->window * 2;
+	}
+
+	// Prefetches from the end of the blocks prefetched so far to a window ahead
+	if (ra->prefetched < ra->next) {
+		ra->prefetched = ra->next;
+	}
+	end = ra->next + ra->window;
+	if (end > (TagLineBlockNumber) maxBlockNumAllowed[tag]) {
+		end = maxBlockNumAllowed[tag];
+	}
+	if (end > ra->prefetched &&
+			submitRequest(ASYNC_PREFETCH, tag, ra->prefetched, end - ra->prefetched, NULL, NULL, NULL) != -1) {
+		ra->prefetched = end;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : prefetchTag
+// Description  : Runs a readahead request under the tag's lock
+//
+// Inputs       : tag - the tag to prefetch
+//                bnum - the first block to prefetch
+//                blks - the number of blocks to prefetch
+// Outputs      : 0 if successful, -1 if failure
+
+int prefetchTag (TagLineNumber tag, TagLineBlockNumber bnum, uint8_t blks) {
+
+	// Declares local variables
+	int result;
+
+	pthread_mutex_lock(&tagLocks[TAG_SHARD(tag)]);
+	pthread_rwlock_rdlock(&rebuildLock);
+	result = readAhead(tag, bnum, blks);
+	pthread_rwlock_unlock(&rebuildLock);
+	pthread_mutex_unlock(&tagLocks[TAG_SHARD(tag)]);
+
+	if (result == -1) {
+		logMessage(LOG_WARNING_LEVEL, "Readahead of tagline %u failed.", tag);
+	}
+	return (result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : readAhead
+// Description  : Reads the blocks of a tag that are not cached into the cache,
+//                one RAID request per run of missing blocks, without counting
+//                them as cache gets. Blocks that have been truncated away since
+//                the readahead was planned are skipped, as are packed blocks,
+//                which the read decompresses as it caches them. Nothing is read if
+//                the tag's coalesced blocks overlap, as RAID does not hold them
+//                yet. Called with the tag's lock held and the rebuild lock held
+//                for reading.
+//
+// Inputs       : tag - the tag to prefetch
+//                bnum - the first block to prefetch
+//                blks - the number of blocks to prefetch
+// Outputs      : 0 if successful, -1 if failure
+
+int readAhead (TagLineNumber tag, TagLineBlockNumber bnum, uint8_t blks) {
+
+	// Declares local variables
+	tableinfo *temp;
+	pendingwrite *run = &pending[TAG_SHARD(tag)];
+	RAIDOpCode response;
+	RAIDDiskID readDisk;
+	RAIDBlockID readBlock;
+	int arr[RAID_OPCODE_MAXVAL] = {0};
+	int done, reading, offset, i, j;
+	char *scratch;
+
+	if (bnum >= (TagLineBlockNumber) maxBlockNumAllowed[tag]) {
+		return (0);
+	}
+	if (bnum + blks > (TagLineBlockNumber) maxBlockNumAllowed[tag]) {
+		blks = maxBlockNumAllowed[tag] - bnum;
+	}
+	if (run->blocks > 0 && run->tag == tag && bnum < run->start + run->blocks
+			&& bnum + blks > run->start) {
+		return (0);
+	}
+
+	if ((scratch = malloc(RAID_MAX_XFER * TAGLINE_BLOCK_SIZE)) == NULL) {
+		return (-1);
+	}
+
+	for (done = 0; done < blks; done += reading) {
+		if ((temp = getTagEntry(tag, bnum + done)) == NULL) {
+			break;
+		}
+		offset = bnum + done - temp->taglineBlock;
+		reading = temp->contiguous - offset;
+		if (reading > blks - done) reading = blks - done;
+
+		// Leaves a packed block to the read, which decompresses it
+		if (temp->packed) {
+			continue;
+		}
+
+		// Reads each run of blocks that are not cached. Finding a block cached
+		// is not a use of it, so a scan does not promote blocks it only passes.
+		for (i = 0; i < reading; i = j) {
+			if (cached_raid_cache(tag, bnum + done + i)) {
+				j = i + 1;
+				continue;
+			}
+			for (j = i + 1; j < reading && !cached_raid_cache(tag, bnum + done + j); j++);
+
+			selectReplica(temp, offset + i, j - i, &readDisk, &readBlock);
+			response = create_raid_request(RAID_READ, j - i, readDisk, 0, 0, readBlock, scratch);
+			extract_raid_response(response, arr, RAID_OPCODE_MAXVAL);
+			if (arr[RAID_OPCODE_STATUS] == 1) {
+				free(scratch);
+				return (-1);
+			}
+
+			// Leaves a run that fails its checksums to the read, which reads
+			// around the bad copy
+			if (TAGLINE_CHECKSUM && verifyBlocks(tag, bnum + done + i, j - i, scratch) == -1) {
+				continue;
+			}
+			put_raid_cache_blocks(tag, bnum + done + i, j - i, scratch);
+		}
+	}
+
+	free(scratch);
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagline_write
+// Description  : Write a number of blocks from the tagline driver. The blocks
+//                are staged in the write coalescing buffer and merged with
+//                neighbouring writes to the same tag; they reach RAID when the
+//                buffer fills, times out, is read, or the driver closes. If
+//                they cannot be written they stay staged, and the next read or
+//                write of the tag fails.
+//
+// Inputs       : tag - the number of the tagline to write from
+//                bnum - the starting block to write from
+//                blks - the number of blocks to write
+//                buf - the place to write the blocks into
+// Outputs      : 0 if successful, -1 if failure
+
+int tagline_write(TagLineNumber tag, TagLineBlockNumber bnum, uint8_t blks, char *buf) {
+
+	// Declares local variables
+	int result;
+
+	if (tag >= maxTaglines) {
+		return (-1);
+	}
+
+	// Writes under the tag's lock, then advances any disk rebuild in progress
+	pthread_mutex_lock(&tagLocks[TAG_SHARD(tag)]);
+	pthread_rwlock_rdlock(&rebuildLock);
+	result = writeTag(tag, bnum, blks, buf);
+	pthread_rwlock_unlock(&rebuildLock);
+
+	if (result == 0) {
+		result = advanceRebuild(REBUILD_SLICE_BLOCKS);
+	}
+	pthread_mutex_unlock(&tagLocks[TAG_SHARD(tag)]);
+
+	return (result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : writeTag
+// Description  : Stages a number of blocks of a tag in the tag's write
+//                coalescing buffer, or writes them straight to RAID while the
+//                buffer holds blocks of another tag that could not be written
+//                out. Called with the tag's lock held and the rebuild lock
+//                held for reading.
+//
+// Inputs       : tag - the number of the tagline to write from
+//                bnum - the starting block to write from
+//                blks - the number of blocks to write
+//                buf - the place to write the blocks into
+// Outputs      : 0 if successful, -1 if failure
+
+int writeTag(TagLineNumber tag, TagLineBlockNumber bnum, uint8_t blks, char *buf) {
+
+	// Declares local variables
+	pendingwrite *run = &pending[TAG_SHARD(tag)];
+	int result;
+
+	// Makes sure the tag exists and the starting block number does not exceed the max block number
+	if (tag >= maxTaglines || bnum > tagLength(tag) || bnum + blks > MAX_TAGLINE_BLOCK_NUMBER) {
+		return (-1);
+	}
+
+	// Writes out coalesced blocks that have waited too long
+	checkPendingWrite(run);
+
+	// Writes out the coalesced blocks if this write cannot be merged into them,
+	// i.e. it is for another tag, leaves a gap, starts before the buffered run
+	// or would grow it past a maximal transfer
+	if (run->blocks > 0 && (run->tag != tag || bnum < run->start ||
+			bnum > run->start + run->blocks ||
+			bnum + blks - run->start > RAID_MAX_XFER)) {
+		flushPendingWrite(run);
+	}
+
+	// Reports coalesced blocks of this tag that could not be written
+	if (takeFlushError(tag) == -1) {
+		return (-1);
+	}
+
+	// Writes straight to RAID while the buffer holds blocks of another tag
+	// that could not be written out
+	if (run->blocks > 0 && run->tag != tag) {
+		result = writeBlocks(tag, bnum, blks, buf);
+		if (growTag(tag, bnum + blks) == -1 || result == -1) {
+			return (-1);
+		}
+		logMessage(LOG_INFO_LEVEL, "TAGLINE : wrote %u blocks to tagline %u, starting block %u.",
+				blks, tag, bnum);
+		return (0);
+	}
+
+	// Starts a new coalesced run if the buffer is empty
+	if (run->blocks == 0) {
+		run->tag = tag;
+		run->start = bnum;
+		gettimeofday(&run->staged, NULL);
+	}
+
+	// Copies the blocks into the run, overwriting any blocks already buffered
+	memcpy(&run->buf[(bnum - run->start) * TAGLINE_BLOCK_SIZE], buf, blks * TAGLINE_BLOCK_SIZE);
+	if (bnum + blks - run->start > run->blocks) {
+		run->blocks = bnum + blks - run->start;
+	}
+
+	// Writes out the run once it is a maximal transfer
+	if (run->blocks == RAID_MAX_XFER) {
+		flushPendingWrite(run);
+		if (takeFlushError(tag) == -1) {
+			return (-1);
+		}
+	}
+
+	// Return successfully
+	logMessage(LOG_INFO_LEVEL, "TAGLINE : wrote %u blocks to tagline %u, starting block %u.",
+			blks, tag, bnum);
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagline_readv
+// Description  : Reads several ranges of blocks, possibly of different taglines,
+//                as one batch. The blocks that miss the cache are planned
+//                together: they are sorted by disk and block, and ranges that are
+//                adjacent on a disk are read with a single RAID request.
+//
+// Inputs       : vec - the ranges to read, each into its own buffer
+//                count - the number of ranges
+// Outputs      : 0 if successful, -1 if failure
+
+int tagline_readv(TagLineVector *vec, int count) {
+
+	// Declares local variables
+	uint32_t shards;
+	int result, i;
+
+	for (i = 0; i < count; i++) {
+		if (vec[i].tag >= maxTaglines) {
+			return (-1);
+		}
+	}
+
+	// Reads under the locks of every tag in the batch, then advances any disk
+	// rebuild in progress
+	shards = lockVectors(vec, count);
+	pthread_rwlock_rdlock(&rebuildLock);
+	result = readVectors(vec, count);
+	pthread_rwlock_unlock(&rebuildLock);
+
+	if (result == 0) {
+		result = advanceRebuild(REBUILD_SLICE_BLOCKS);
+	}
+	unlockVectors(shards);
+
+	return (result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagline_writev
+// Description  : Writes several ranges of blocks, possibly of different
+//                taglines, as one batch. The ranges are applied in order as
+//                tagline_write would apply them, stopping at the first invalid
+//                one, but their blocks are written straight to RAID together:
+//                both copies of every range are sorted by disk and block and
+//                adjacent ranges go out in a single request. The new blocks of
+//                the batch are allocated from the same pair of disks so that
+//                they tend to be adjacent too.
+//
+// Inputs       : vec - the ranges to write, each from its own buffer
+//                count - the number of ranges
+// Outputs      : 0 if successful, -1 if failure
+
+int tagline_writev(TagLineVector *vec, int count) {
+
+	// Declares local variables
+	uint32_t shards;
+	int result, i;
+
+	for (i = 0; i < count; i++) {
+		if (vec[i].tag >= maxTaglines) {
+			return (-1);
+		}
+	}
+
+	// Writes under the locks of every tag in the batch, then advances any disk
+	// rebuild in progress
+	shards = lockVectors(vec, count);
+	pthread_rwlock_rdlock(&rebuildLock);
+	result = writeVectors(vec, count);
+	pthread_rwlock_unlock(&rebuildLock);
+
+	if (result == 0) {
+		result = advanceRebuild(REBUILD_SLICE_BLOCKS);
+	}
+	unlockVectors(shards);
+
+	return (result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagline_submit_read
+// Description  : Queues a read and returns without waiting for it. The request
+//                is run by a driver thread; when it finishes, done is called
+//                with its status or, if done is NULL, it is queued to be reaped.
+//                buf must stay valid until then.
+//
+// Inputs       : tag - the number of the tagline to read from
+//                bnum - the starting block to read from
+//                blks - the number of blocks to read
+//                buf - memory block to read the blocks into
+//                done - the function to call when the read finishes, or NULL
+//                arg - passed to done or returned with the completion
+// Outputs      : the request handle, or -1 if the request could not be queued
+
+TagLineRequest tagline_submit_read(TagLineNumber tag, TagLineBlockNumber bnum, uint8_t blks,
+		char *buf, TagLineCallback done, void *arg) {
+	return submitRequest(ASYNC_READ, tag, bnum, blks, buf, done, arg);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagline_submit_write
+// Description  : Queues a write and returns without waiting for it, as
+//                tagline_submit_read does. Requests run concurrently, so
+//                overlapping requests to the same blocks complete in no
+//                particular order.
+//
+// Inputs       : tag - the number of the tagline to write to
+//                bnum - the starting block to write to
+//                blks - the number of blocks to write
+//                buf - the blocks to write
+//                done - the function to call when the write finishes, or NULL
+//                arg - passed to done or returned with the completion
+// Outputs      : the request handle, or -1 if the request could not be queued
+
+TagLineRequest tagline_submit_write(TagLineNumber tag, TagLineBlockNumber bnum, uint8_t blks,
+		char *buf, TagLineCallback done, void *arg) {
+	return submitRequest(ASYNC_WRITE, tag, bnum, blks, buf, done, arg);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagline_reap
+// Description  : Collects finished requests that were submitted without a
+//                callback, oldest first
+//
+// Inputs       : done - where to store the completions
+//                max - the most completions to collect
+//                wait - nonzero to wait until at least one request has finished,
+//                       unless none is outstanding
+// Outputs      : the number of completions collected
+
+int tagline_reap(TagLineCompletion *done, int max, int wait) {
+
+	// Declares local variables
+	int count = 0;
+
+	pthread_mutex_lock(&asyncLock);
+	while (wait && doneCount == 0 && asyncQueued + asyncRunning > 0) {
+		pthread_cond_wait(&asyncFinished, &asyncLock);
+	}
+
+	// Copies out the oldest completions
+	while (count < max && doneCount > 0) {
+		done[count++] = asyncDone[doneHead];
+		doneHead = (doneHead + 1) % ASYNC_QUEUE_DEPTH;
+		doneCount--;
+	}
+	pthread_mutex_unlock(&asyncLock);
+
+	return (count);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagline_delete
+// Description  : Delete a tagline, giving its blocks back to the allocator
+//
+// Inputs       : tag - the number of the tagline to delete
+// Outputs      : 0 if successful, -1 if failure
+
+int tagline_delete(TagLineNumber tag) {
+
+	// Return the result of truncating the tagline to nothing
+	if (tagline_truncate(tag, 0) == -1) {
+		return (-1);
+	}
+
+	logMessage(LOG_INFO_LEVEL, "TAGLINE : deleted tagline %u.", tag);
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagline_truncate
+// Description  : Shorten a tagline to a number of blocks, giving the blocks
+//                past the new end back to the allocator
+//
+// Inputs       : tag - the number of the tagline to truncate
+//                nblocks - the number of blocks to keep
+// Outputs      : 0 if successful, -1 if failure
+
+int tagline_truncate(TagLineNumber tag, TagLineBlockNumber nblocks) {
+
+	// Declares local variables
+	int result;
+
+	// Makes sure the tag exists
+	if (tag >= maxTaglines) {
+		return (-1);
+	}
+
+	// Frees the blocks and records the truncate for a warm restart, with every
+	// other request kept out; a tagline is never grown by a truncate
+	pthread_mutex_lock(&tagLocks[TAG_SHARD(tag)]);
+	if (nblocks >= (TagLineBlockNumber) tagLength(tag)) {
+		pthread_mutex_unlock(&tagLocks[TAG_SHARD(tag)]);
+		return (0);
+	}
+	pthread_rwlock_wrlock(&rebuildLock);
+	pthread_mutex_lock(&mapLock);
+	result = trimTag(tag, nblocks);
+	if (result == 0) {
+		result = journalAppend(JOURNAL_TRUNCATE, tag, nblocks, 0, 0, 0, 0, 0);
+	}
+	pthread_mutex_unlock(&mapLock);
+	pthread_rwlock_unlock(&rebuildLock);
+	pthread_mutex_unlock(&tagLocks[TAG_SHARD(tag)]);
+
+	if (result == -1) {
+		return (-1);
+	}
+
+	logMessage(LOG_INFO_LEVEL, "TAGLINE : truncated tagline %u to %u blocks.", tag, nblocks);
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagline_close
+// Description  : Close the tagline interface
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int tagline_close(void) {
+
+	// Declares local variables
+	RAIDOpCode response;
+	int arr[RAID_OPCODE_MAXVAL] = {0};
+	int i, result = 0;
+
+	// Waits for the submitted requests to finish and stops their threads
+	stopWorkers();
+	stopScrubber();
+
+	// Writes out any coalesced blocks and any blocks held dirty in the cache,
+	// then finishes any rebuild still in progress. No other request may be
+	// running by now. A failure does not stop the rest from being written; the
+	// first one is returned once the driver is closed.
+	for (i = 0; i < TAG_LOCK_SHARDS; i++) {
+		if (flushPendingWrite(&pending[i]) == -1) {
+			result = -1;
+		}
+	}
+	if (flush_raid_cache() == -1) {
+		result = -1;
+	}
+	if (rebuildSlice(DISK_BLOCKS) == -1) {
+		result = -1;
+	}
+
+	// Leaves a compact journal for the next restart
+	if (journalCheckpoint(TRUE) == -1) {
+		logMessage(LOG_ERROR_LEVEL, "The journal could not be written.");
+		result = -1;
+	}
+	if (journal != NULL) {
+		fclose(journal);
+		journal = NULL;
+	}
+
+	// Frees the allocated pointers
+	free(failureBuf);
+	failureBuf = NULL;
+
+	for (i = 0; i < TAG_LOCK_SHARDS; i++) {
+		free(pending[i].buf);
+		pending[i].buf = NULL;
+		pthread_mutex_destroy(&tagLocks[i]);
+	}
+
+	free(maxBlockNumAllowed);
+	maxBlockNumAllowed = NULL;
+	free(flushFailed);
+	flushFailed = NULL;
+
+	for (i = 0; i < numChunks; i++) {
+		free(raidtable[i]);
+		raidtable[i] = NULL;
+	}
+
+	free(raidtable);
+	raidtable = NULL;
+	numChunks = 0;
+
+	free(freeExtents);
+	freeExtents = NULL;
+	numFreeExtents = 0;
+	freeExtentsSize = 0;
+
+	free(tagDirectory);
+	tagDirectory = NULL;
+	numEntries = 0;
+
+	free(readahead);
+	readahead = NULL;
+
+	for (i = 0; i < NUM_DISKS; i++) {
+		free(diskExtents[i]);
+		diskExtents[i] = NULL;
+		diskExtentCount[i] = 0;
+		diskExtentSize[i] = 0;
+	}
+
+	free(dedupBlocks);
+	dedupBlocks = NULL;
+	free(dedupEntries);
+	dedupEntries = NULL;
+	dedupCount = 0;
+	dedupSize = 0;
+
+	free(blockChecksums);
+	blockChecksums = NULL;
+	free(checksumBitmap);
+	checksumBitmap = NULL;
+
+	// Prints out dedup statistics
+	if (TAGLINE_DEDUP) {
+		logMessage(LOG_OUTPUT_LEVEL, "--- Dedup statistics ---");
+		logMessage(LOG_OUTPUT_LEVEL, "Blocks mapped to a shared copy: %d", dedupShared);
+		logMessage(LOG_OUTPUT_LEVEL, "Blocks rewritten unchanged: %d", dedupSkipped);
+	}
+
+	// Prints out compression statistics
+	if (TAGLINE_COMPRESS) {
+		logMessage(LOG_OUTPUT_LEVEL, "--- Compression statistics ---");
+		logMessage(LOG_OUTPUT_LEVEL, "Blocks packed: %d", packedBlocks);
+		logMessage(LOG_OUTPUT_LEVEL, "Blocks they were packed into: %d", packBlocksUsed);
+	}
+
+	// Prints out scrub statistics
+	if (TAGLINE_SCRUB_RATE > 0) {
+		logMessage(LOG_OUTPUT_LEVEL, "--- Scrub statistics ---");
+		logMessage(LOG_OUTPUT_LEVEL, "Blocks verified: %d", scrubVerified);
+		logMessage(LOG_OUTPUT_LEVEL, "Blocks repaired: %d", scrubRepaired);
+	}
+
+	// Prints out checksum statistics
+	if (TAGLINE_CHECKSUM) {
+		logMessage(LOG_OUTPUT_LEVEL, "--- Checksum statistics ---");
+		logMessage(LOG_OUTPUT_LEVEL, "Blocks read that failed their checksum: %d", checksumFailures);
+	}
+
+	// Prints out cache statistics
+	logMessage(LOG_OUTPUT_LEVEL, "--- Cache statistics ---");
+	logMessage(LOG_OUTPUT_LEVEL, "Cache policy: %s", raid_cache_policy());
+	logMessage(LOG_OUTPUT_LEVEL, "Cache gets: %d", hits + misses);
+	logMessage(LOG_OUTPUT_LEVEL, "Cache inserts: %d", misses);
+	logMessage(LOG_OUTPUT_LEVEL, "Cache hits: %d", hits);
+	logMessage(LOG_OUTPUT_LEVEL, "Cache misses: %d", misses);
+	logMessage(LOG_OUTPUT_LEVEL, "Cache hit rate: %5.2f%%", (double) hits / (hits + misses) * 100);
+
+	// Close the RAID cache
+	close_raid_cache();
+
+	// Closes the RAID disks
+	response = create_raid_request(RAID_CLOSE, 0, 0, 0, 0, 0, NULL);
+	
+	// Checks if the RAID command executed successfully
+	extract_raid_response(response, arr, RAID_OPCODE_MAXVAL);
+	if (arr[RAID_OPCODE_STATUS] == 1) {
+		logMessage(LOG_ERROR_LEVEL, "A RAID command failed. Bye bye!");
+		return (-1);
+	}
+
+	// Reports a failure to write out the blocks or the journal
+	if (result == -1) {
+		logMessage(LOG_ERROR_LEVEL, "TAGLINE storage device: closed without writing everything out.");
+		return (-1);
+	}
+
+	// Return successfully
+	logMessage(LOG_INFO_LEVEL, "TAGLINE storage device: closing completed.");
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : raid_disk_signal
+// Description  : A disk has failed which needs to be recovered
+//
+// Inputs       : none
+// Outputs      : 0 success, 1 is failure
+
+int raid_disk_signal(void) {
+	
+	// Declares local variables
+	int failures;
+
+	// Keeps every request out while the failed disks are replaced
+	pthread_rwlock_wrlock(&rebuildLock);
+	failures = handleDiskFailures();
+	pthread_rwlock_unlock(&rebuildLock);
+
+	if (failures == -1) {
+		return (1);
+	}
+
+	// A signal without a failed disk is reported instead of searched for forever
+	if (failures == 0) {
+		logMessage(LOG_ERROR_LEVEL, "A disk failure was signalled but no disk has failed.");
+		return (1);
+	}
+
+	// Return successfully
+	logMessage(LOG_INFO_LEVEL, "TAGLINE processed raid disk signal successfully.");
+
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : handleDiskFailures
+// Description  : Formats every disk the disk state table reports as failed and
+//                starts its rebuild. Called with the rebuild lock held for writing.
+//
+// Inputs       : none
+// Outputs      : the number of failed disks, or -1 on failure
+
+int handleDiskFailures(void) {
+	
+	// Declares local variables
+	RAIDDiskID diskFailed;
+	RAIDOpCode response;
+	int arr[RAID_OPCODE_MAXVAL] = {0};
+	int failures = 0;
+
+	// Determines which disks have failed
+	if (refreshDiskStates() == -1) {
+		logMessage(LOG_ERROR_LEVEL, "A RAID command failed. Bye bye!");
+		return (-1);
+	}
+
+	for (diskFailed = 0; diskFailed < NUM_DISKS; diskFailed++) {
+		if (diskState[diskFailed] != RAID_DISK_FAILED) {
+			continue;
+		}
+		failures++;
+
+		// A rebuild still in progress is finished first while its sources are
+		// readable; if the same disk failed again its partial rebuild is dropped
+		if (rebuildTarget == (int) diskFailed) {
+			free(rebuildPlan);
+			rebuildPlan = NULL;
+			rebuildTarget = -1;
+			releaseDeferredBlocks();
+		}
+		else if (rebuildSlice(DISK_BLOCKS) == -1) {
+			logMessage(LOG_ERROR_LEVEL, "Rebuilding disk %d failed. Bye bye!", rebuildTarget);
+			return (-1);
+		}
+
+		// Formats the failed disk
+		response = create_raid_request(RAID_FORMAT, 0, diskFailed, 0, 0, 0, NULL);
+
+		// Checks if the RAID command executed successfully
+		extract_raid_response(response, arr, RAID_OPCODE_MAXVAL);
+		if (arr[RAID_OPCODE_STATUS] == 1) {
+			logMessage(LOG_ERROR_LEVEL, "A RAID command failed. Bye bye!");
+			return (-1);
+		}
+		diskState[diskFailed] = RAID_DISK_READY;
+
+		// Plans the copy of every extent of the failed disk back from its surviving
+		// copy. The disk is served in degraded mode and rebuilt in slices between
+		// requests; blocks still dirty in the cache reach it when they are written back.
+		if (planRebuild(diskFailed) == -1) {
+			logMessage(LOG_ERROR_LEVEL, "Planning the rebuild of disk %d failed. Bye bye!", diskFailed);
+			return (-1);
+		}
+	}
+
+	return (failures);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : create_raid_request
+// Description  : Constructs a request structure and makes a request.
+//		  
+//
+// Inputs       : requestType - value that indicates the request type
+//		  numBlocks - the number of blocks or number of tracks for RAID_INIT
+//		  diskNum - the disk number
+//		  unused - set to 0 for now
+//		  status - 0 for success or 1 for failure
+//		  blockID - the block ID
+//		  buf - buffer required by the bus request
+//		  
+// Outputs      : the response opcode
+
+RAIDOpCode create_raid_request (uint64_t requestType, uint64_t numBlocks, uint64_t diskNum,
+	uint64_t unused, uint64_t status, uint64_t blockID, void *buf){
+	
+	// Constructs the opcode and makes a request
+	return client_raid_bus_request(packRaidOpcode(requestType, numBlocks, diskNum, unused,
+		status, blockID), buf);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : packRaidOpcode
+// Description  : Packs the fields of a request into an opcode
+//
+// Inputs       : requestType - value that indicates the request type
+//		  numBlocks - the number of blocks or number of tracks for RAID_INIT
+//		  diskNum - the disk number
+//		  unused - set to 0 for now
+//		  status - 0 for success or 1 for failure
+//		  blockID - the block ID
+// Outputs      : the request opcode
+
+RAIDOpCode packRaidOpcode (uint64_t requestType, uint64_t numBlocks, uint64_t diskNum,
+	uint64_t unused, uint64_t status, uint64_t blockID) {
+
+	// Constructs the request structure
+	requestType = (requestType & STRCTURE_REQ) << (64 - NUMBER_REQ_BITS);
+	numBlocks = (numBlocks & STRUCTURE_BLOCK_NUM) << (64 - NUMBER_REQ_BITS - NUMBER_BLOCK_NUM_BITS);
+	diskNum = (diskNum & STRUCTURE_DISK_ID) << (64 - NUMBER_REQ_BITS - NUMBER_BLOCK_NUM_BITS - NUMBER_DISK_ID_BITS);
+	unused = (unused & STRUCTURE_UNUSED) << (64 - NUMBER_REQ_BITS - NUMBER_BLOCK_NUM_BITS - NUMBER_DISK_ID_BITS
+		- NUMBER_UNUSED_BITS);
+	status = (status & STRUCTURE_STATUS) << (64 - NUMBER_REQ_BITS - NUMBER_BLOCK_NUM_BITS - NUMBER_DISK_ID_BITS
+		- NUMBER_UNUSED_BITS - NUMBER_STATUS_BIT);
+	blockID = (blockID & STRUCTURE_BLOCK_ID);
+	
+	// Creates the opcode
+	return (requestType|numBlocks|diskNum|unused|status|blockID);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : extract_raid_response
+// Description  : Extracts an opcode and stores the data in an array. 
+//
+// Inputs       : resp -  the response opcode
+//		  arr - the array that will hold the values
+//		  arrLen - the length of the array (must be at least 6)
+
+void extract_raid_response (RAIDOpCode resp, int arr[], int arrLen){
+
+	// Ensures that the length of the array is long enough
+	if (arrLen < 6) {
+		return;
+	}
+
+	// Extracts each field from the opcode and stores them in the array
+	arr[RAID_OPCODE_REQTYPE] = (resp >> (64 - NUMBER_REQ_BITS)) & STRCTURE_REQ;
+	arr[RAID_OPCODE_BLOCKS] = (resp >> (64 - NUMBER_REQ_BITS - NUMBER_BLOCK_NUM_BITS)) & STRUCTURE_BLOCK_NUM;
+	arr[RAID_OPCODE_DISKID] = (resp >> (64 - NUMBER_REQ_BITS - NUMBER_BLOCK_NUM_BITS - NUMBER_DISK_ID_BITS)) &
+		STRUCTURE_DISK_ID;
+	arr[RAID_OPCODE_UNUSED] = (resp >> (64 - NUMBER_REQ_BITS - NUMBER_BLOCK_NUM_BITS - NUMBER_DISK_ID_BITS
+		- NUMBER_UNUSED_BITS)) & STRUCTURE_UNUSED;
+	arr[RAID_OPCODE_STATUS] = (resp >> (64 - NUMBER_REQ_BITS - NUMBER_BLOCK_NUM_BITS - NUMBER_DISK_ID_BITS
+		- NUMBER_UNUSED_BITS - NUMBER_STATUS_BIT)) & STRUCTURE_STATUS;
+	arr[RAID_OPCODE_BLOCKID] = (resp) & STRUCTURE_BLOCK_ID;
+
+	return;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : writeBlocks
+// Description  : Writes a number of blocks of a tag to RAID. Blocks that
+// 		  compress well are packed when compression is on; the rest are
+// 		  stored whole. The checksums of the blocks are recorded.
+//
+// Inputs       : tag - the number of the tagline to write to
+// 		  bnum - the starting block to write
+// 		  blks - the number of blocks to write
+// 		  buf - the blocks to write
+// Outputs	: 0 if successful, -1 if failure
+
+int writeBlocks (TagLineNumber tag, TagLineBlockNumber bnum, uint8_t blks, char *buf) {
+
+	// Declares local variables
+	int result;
+
+	if (TAGLINE_COMPRESS) {
+		result = compressWrite(tag, bnum, blks, buf);
+	}
+	else {
+		result = writeWholeBlocks(tag, bnum, blks, buf);
+	}
+
+	// Forgets the checksums of the blocks if the write failed part way
+	setChecksums(tag, bnum, blks, (result == 0) ? buf : NULL);
+
+	return (result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : writeWholeBlocks
+// Description  : Writes a number of blocks of a tag to RAID uncompressed,
+// 		  overwriting the blocks that are already stored whole and
+// 		  inserting a new extent for each run of the rest. A packed block
+// 		  is unmapped first, as its block is shared.
+//
+// Inputs       : tag - the number of the tagline to write to
+// 		  bnum - the starting block to write
+// 		  blks - the number of blocks to write
+// 		  buf - the blocks to write
+// Outputs	: 0 if successful, -1 if failure
+
+int writeWholeBlocks (TagLineNumber tag, TagLineBlockNumber bnum, uint8_t blks, char *buf) {
+
+	// Declares local variables
+	int blksWritten = 0, offset, writing, result;
+	tableinfo *temp;
+
+	// Identical blocks are stored once
+	if (TAGLINE_DEDUP) {
+		return (dedupWrite(tag, bnum, blks, buf));
+	}
+
+	while (blksWritten < blks) {
+		// Overwrites a block stored whole from its position in its extent up
+		// to the end of the extent
+		temp = (tableinfo *) getTagEntry(tag, bnum + blksWritten);
+		if (temp != NULL && !temp->packed) {
+			offset = bnum + blksWritten - temp->taglineBlock;
+			writing = temp->contiguous - offset;
+			if (writing > blks - blksWritten) writing = blks - blksWritten;
+
+			if (storeBlocks(tag, bnum + blksWritten, temp->disk, temp->blockID + offset, temp->diskCopy,
+					temp->blockIDCopy + offset, writing, &buf[blksWritten * TAGLINE_BLOCK_SIZE]) == -1) {
+				return (-1);
+			}
+
+			// Increases the amount of blocks overwritten
+			blksWritten += writing;
+			continue;
+		}
+
+		// Gathers the run of blocks that are new or packed, unmapping the packed ones
+		for (writing = 0; blksWritten + writing < blks; writing++) {
+			temp = (tableinfo *) getTagEntry(tag, bnum + blksWritten + writing);
+			if (temp != NULL && !temp->packed) {
+				break;
+			}
+			if (temp != NULL) {
+				pthread_mutex_lock(&mapLock);
+				result = unmapBlock(tag, bnum + blksWritten + writing);
+				if (result == 0) {
+					result = journalAppend(JOURNAL_UNMAP, tag, bnum + blksWritten + writing, 0, 0, 0, 0, 0);
+				}
+				pthread_mutex_unlock(&mapLock);
+				if (result == -1) {
+					return (-1);
+				}
+			}
+		}
+
+		// Inserts the run as one extent
+		if (insertEntry(tag, bnum + blksWritten, writing,
+				&buf[blksWritten * TAGLINE_BLOCK_SIZE]) == -1) {
+			logMessage(LOG_ERROR_LEVEL, "Insert has failed. Bye bye!");
+			return (-1);
+		}
+		blksWritten += writing;
+	}
+
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : storeBlocks
+// Description  : Stores a run of blocks of a tag at their primary and backup
+// 		  locations. In write-back mode the blocks are only held dirty in
+// 		  the cache; otherwise both copies are written to RAID and the
+// 		  blocks are then cached once, under the tag.
+//
+// Inputs       : tag - the tag of the blocks
+// 		  bnum - the first block of the tag
+// 		  disk - the disk of the primary copy
+// 		  blockID - the first block of the primary copy
+// 		  diskCopy - the disk of the backup copy
+// 		  blockIDCopy - the first block of the backup copy
+// 		  blks - the number of blocks
+// 		  buf - the blocks to store
+// Outputs	: 0 if successful, -1 if failure
+
+int storeBlocks (TagLineNumber tag, TagLineBlockNumber bnum, RAIDDiskID disk, RAIDBlockID blockID,
+	RAIDDiskID diskCopy, RAIDBlockID blockIDCopy, int blks, char *buf) {
+
+	// Declares local variables
+	int i;
+
+	// Holds the blocks in the cache until they are written back
+	if (raid_cache_write_back()) {
+		for (i = 0; i < blks; i++) {
+			if (get_raid_cache(tag, bnum + i) == NULL) misses++; else hits++;
+		}
+		if (put_raid_cache_dirty(tag, bnum, disk, blockID, diskCopy, blockIDCopy, blks, buf) == -1) {
+			logMessage(LOG_ERROR_LEVEL, "Caching a dirty block failed.");
+			return (-1);
+		}
+		return (0);
+	}
+
+	if (writeCopies(disk, blockID, diskCopy, blockIDCopy, blks, buf) == -1) {
+		return (-1);
+	}
+
+	// Updates every block in the cache
+	for (i = 0; i < blks; i++) {
+		if (get_raid_cache(tag, bnum + i) == NULL) misses++; else hits++;
+	}
+	put_raid_cache_blocks(tag, bnum, blks, buf);
+
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : writeCopies
+// Description  : Writes a run of blocks to RAID at their primary and backup
+// 		  locations
+//
+// Inputs       : disk - the disk of the primary copy
+// 		  blockID - the first block of the primary copy
+// 		  diskCopy - the disk of the backup copy
+// 		  blockIDCopy - the first block of the backup copy
+// 		  blks - the number of blocks
+// 		  buf - the blocks to write
+// Outputs	: 0 if successful, -1 if failure
+
+int writeCopies (RAIDDiskID disk, RAIDBlockID blockID, RAIDDiskID diskCopy,
+	RAIDBlockID blockIDCopy, int blks, char *buf) {
+
+	// Declares local variables
+	RAIDOpCode response, responsetwo;
+	int arr[RAID_OPCODE_MAXVAL] = {0};
+	int arrtwo[RAID_OPCODE_MAXVAL] = {0};
+
+	// Writes into both RAID designations. A copy waiting to be rebuilt is left
+	// stale; the rebuild brings it up to date from the copy written here.
+	if (!isStale(disk, blockID, blks)) {
+		response = create_raid_request
+			(RAID_WRITE, blks, disk, 0, 0, blockID, buf);
+		extract_raid_response(response, arr, RAID_OPCODE_MAXVAL);
+	}
+	if (!isStale(diskCopy, blockIDCopy, blks)) {
+		responsetwo = create_raid_request
+			(RAID_WRITE, blks, diskCopy, 0, 0, blockIDCopy, buf);
+		extract_raid_response(responsetwo, arrtwo, RAID_OPCODE_MAXVAL);
+	}
+
+	// Checks if the RAID commands executed successfully 
+	if (arr[RAID_OPCODE_STATUS] == 1 || arrtwo[RAID_OPCODE_STATUS] == 1) {
+		logMessage(LOG_ERROR_LEVEL, "A RAID command failed.");
+		return (-1);
+	}
+
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : flushPendingWrite
+// Description  : Writes the coalesced run in the write coalescing buffer to RAID
+// 		  and empties the buffer. If the write fails the run stays
+// 		  staged, to be written again later, and the failure is
+// 		  recorded against its tag for takeFlushError to report.
+//
+// Inputs       : run - the write coalescing buffer
+// Outputs	: 0 if successful, -1 if failure
+
+int flushPendingWrite (pendingwrite *run) {
+
+	// Declares local variables
+	int blocks = run->blocks, result;
+
+	// Nothing to do if the buffer is empty
+	if (blocks == 0) {
+		return (0);
+	}
+
+	result = writeBlocks(run->tag, run->start, blocks, run->buf);
+
+	// Grows the tag over the blocks mapped by now, even if the write failed
+	// part way
+	if (growTag(run->tag, run->start + blocks) == -1) {
+		result = -1;
+	}
+
+	if (result == -1) {
+		flushFailed[run->tag] = 1;
+		logMessage(LOG_ERROR_LEVEL, "Coalesced write to tagline %u failed.", run->tag);
+		return (-1);
+	}
+	run->blocks = 0;
+
+	logMessage(LOG_INFO_LEVEL, "TAGLINE : flushed %d coalesced blocks to tagline %u, starting block %u.",
+			blocks, run->tag, run->start);
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagLength
+// Description  : Returns the number of blocks of a tag, counting the coalesced
+// 		  blocks that are not mapped yet. maxBlockNumAllowed only counts
+// 		  mapped blocks, so neither it nor the journal ever claims a block
+// 		  that has no extent. Called with the tag's lock held.
+//
+// Inputs       : tag - the tag
+// Outputs	: the number of blocks
+
+int tagLength (TagLineNumber tag) {
+
+	// Declares local variables
+	pendingwrite *run = &pending[TAG_SHARD(tag)];
+
+	if (run->blocks > 0 && run->tag == tag
+			&& run->start + run->blocks > (TagLineBlockNumber) maxBlockNumAllowed[tag]) {
+		return (run->start + run->blocks);
+	}
+	return (maxBlockNumAllowed[tag]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : growTag
+// Description  : Grows a tag over the mapped blocks that follow its last
+// 		  block, up to a given end, and journals its new length. Called
+// 		  once the extents of a write are mapped and journaled, so the
+// 		  length never covers a block without an extent. Called with the
+// 		  tag's lock held.
+//
+// Inputs       : tag - the tag
+// 		  end - the block past the last one written
+// Outputs	: 0 if successful, -1 if failure
+
+int growTag (TagLineNumber tag, TagLineBlockNumber end) {
+
+	// Declares local variables
+	TagLineBlockNumber last = maxBlockNumAllowed[tag];
+	int result = 0;
+
+	while (last < end && getTagEntry(tag, last) != NULL) {
+		last++;
+	}
+	if (last > (TagLineBlockNumber) maxBlockNumAllowed[tag]) {
+		maxBlockNumAllowed[tag] = last;
+		pthread_mutex_lock(&mapLock);
+		result = journalAppend(JOURNAL_MAXBLOCK, tag, last, 0, 0, 0, 0, 0);
+		pthread_mutex_unlock(&mapLock);
+	}
+
+	return (result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : checkPendingWrite
+// Description  : Writes out the write coalescing buffer if its run has been
+// 		  waiting for longer than COALESCE_TIMEOUT_USEC. A failure is
+// 		  recorded against the run's tag, which may not be the caller's.
+//
+// Inputs       : run - the write coalescing buffer
+// Outputs	: none
+
+void checkPendingWrite (pendingwrite *run) {
+
+	// Declares local variables
+	struct timeval now;
+
+	if (run->blocks == 0) {
+		return;
+	}
+
+	gettimeofday(&now, NULL);
+	if (((now.tv_sec - run->staged.tv_sec) * 1000000) +
+			(now.tv_usec - run->staged.tv_usec) > COALESCE_TIMEOUT_USEC) {
+		flushPendingWrite(run);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : takeFlushError
+// Description  : Reports, once, that coalesced blocks of a tag could not be
+// 		  written out. Called with the tag's lock held.
+//
+// Inputs       : tag - the tag
+// Outputs	: -1 if a write of the tag's coalesced blocks failed, 0 otherwise
+
+int takeFlushError (TagLineNumber tag) {
+
+	if (flushFailed[tag]) {
+		flushFailed[tag] = 0;
+		logMessage(LOG_ERROR_LEVEL, "Coalesced blocks of tagline %u have not been written.", tag);
+		return (-1);
+	}
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : selectReplica
+// Description  : Chooses which copy of an extent a read is sent to. A copy
+//                on a failed disk or waiting to be rebuilt is never read. A copy on
+//                the track its disk last accessed is preferred; otherwise the
+//                disk that has served fewer blocks is chosen, alternating
+//                between the copies on a tie.
+//
+// Inputs       : entry - the extent being read
+//                offset - the first block of the read within the extent
+//                blks - the number of blocks read
+//                disk - the disk to read from (output)
+//                blockID - the first block to read on that disk (output)
+// Outputs      : none
+
+void selectReplica (tableinfo *entry, int offset, int blks, RAIDDiskID *disk,
+	RAIDBlockID *blockID) {
+
+	// Declares local variables
+	int primaryTrack, copyTrack, primaryNear, copyNear, useCopy;
+
+	primaryTrack = (entry->blockID + offset) / RAID_TRACK_BLOCKS;
+	copyTrack = (entry->blockIDCopy + offset) / RAID_TRACK_BLOCKS;
+	primaryNear = (diskLastTrack[entry->disk] == primaryTrack);
+	copyNear = (diskLastTrack[entry->diskCopy] == copyTrack);
+
+	// Picks the copy that is not waiting to be rebuilt, then by track
+	// locality, then by load, then in turn
+	if (!usableCopy(entry->disk, entry->blockID + offset, blks)) {
+		useCopy = 1;
+	}
+	else if (!usableCopy(entry->diskCopy, entry->blockIDCopy + offset, blks)) {
+		useCopy = 0;
+	}
+	else if (primaryNear != copyNear) {
+		useCopy = copyNear;
+	}
+	else if (diskReadBlocks[entry->disk] != diskReadBlocks[entry->diskCopy]) {
+		useCopy = (diskReadBlocks[entry->diskCopy] < diskReadBlocks[entry->disk]);
+	}
+	else {
+		useCopy = atomic_fetch_xor(&replicaTurn, 1);
+	}
+
+	if (useCopy) {
+		*disk = entry->diskCopy;
+		*blockID = entry->blockIDCopy + offset;
+	}
+	else {
+		*disk = entry->disk;
+		*blockID = entry->blockID + offset;
+	}
+
+	// Records where the chosen disk is left and how much it has served
+	diskLastTrack[*disk] = (*blockID + blks - 1) / RAID_TRACK_BLOCKS;
+	diskReadBlocks[*disk] += blks;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : usableCopy
+// Description  : Tells whether a copy of a range of blocks can be read, i.e.
+//                its disk has not failed and the range is not waiting to be rebuilt
+//
+// Inputs       : disk - the disk of the copy
+//                blockID - the first block of the copy
+//                blks - the number of blocks
+// Outputs      : 1 if the copy can be read, 0 otherwise
+
+int usableCopy (RAIDDiskID disk, RAIDBlockID blockID, int blks) {
+	return (diskState[disk] != RAID_DISK_FAILED && !isStale(disk, blockID, blks));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : refreshDiskStates
+// Description  : Updates the disk state table with a STATUS request for every
+//                disk, sent as one pipelined round trip
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int refreshDiskStates (void) {
+
+	// Declares local variables
+	RAIDOpCode ops[NUM_DISKS];
+	int arr[RAID_OPCODE_MAXVAL] = {0};
+	int i;
+
+	for (i = 0; i < NUM_DISKS; i++) {
+		ops[i] = packRaidOpcode(RAID_STATUS, 0, i, 0, 0, 0);
+	}
+
+	if (client_raid_bus_pipeline(ops, NUM_DISKS) == -1) {
+		return (-1);
+	}
+
+	// The state of each disk is returned in the block ID field
+	for (i = 0; i < NUM_DISKS; i++) {
+		extract_raid_response(ops[i], arr, RAID_OPCODE_MAXVAL);
+		if (arr[RAID_OPCODE_STATUS] == 1) {
+			return (-1);
+		}
+		diskState[i] = arr[RAID_OPCODE_BLOCKID];
+	}
+
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : insertEntry
+// Description  : Creates a new entry with the given tagline info and opcodes, provided 
+// 		  that the tag number and block number combination does not already
+// 		  exist
+// Inputs       : tagNum - the tag number
+// 		  tagBlockNum - the starting block number
+// 		  blks - the number of blocks
+// 		  buf - the buffer
+// Outputs	: 0 for success, or -1 for failure
+
+int insertEntry (TagLineNumber tagNum, TagLineBlockNumber tagBlockNum, uint8_t blks, char* buf) {
+
+	// Declares variables
+	RAIDDiskID newDisk, backupDisk;
+	RAIDBlockID newRAIDBlock, backupRAIDBlock;
+	int result;
+
+	// Ensures that the tag number and block number combination does not already exist
+	// and that every block fits in the tag directory
+	if (tagNum >= maxTaglines || tagBlockNum + blks > MAX_TAGLINE_BLOCK_NUMBER) {
+		return (-1);
+	}
+	if (getTagEntry(tagNum, tagBlockNum) != NULL) {
+		return (-1);
+	}
+
+	// Selects contiguous ranges of free blocks for both copies
+	if (allocateCopies(blks, &newDisk, &newRAIDBlock, &backupDisk, &backupRAIDBlock) == -1) {
+		return (-1);
+	}
+
+	// Writes into the primary and backup RAID designations and cache
+	if (storeBlocks(tagNum, tagBlockNum, newDisk, newRAIDBlock, backupDisk, backupRAIDBlock, blks, buf) == -1) {
+		pthread_mutex_lock(&mapLock);
+		markBlocks(newDisk, newRAIDBlock, blks, FALSE);
+		markBlocks(backupDisk, backupRAIDBlock, blks, FALSE);
+		pthread_mutex_unlock(&mapLock);
+		return (-1);
+	}
+
+	// Maps the blocks to a new extent and records it in the journal
+	pthread_mutex_lock(&mapLock);
+	if (mapExtent(tagNum, tagBlockNum, blks, newDisk, newRAIDBlock, backupDisk, backupRAIDBlock) == NULL) {
+		pthread_mutex_unlock(&mapLock);
+		logMessage(LOG_ERROR_LEVEL, "Memory allocation failed.");
+		return (-1);
+	}
+	referenceBlocks(newDisk, newRAIDBlock, blks);
+	result = journalAppend(JOURNAL_EXTENT, tagNum, tagBlockNum, blks, newDisk, newRAIDBlock,
+			backupDisk, backupRAIDBlock);
+	pthread_mutex_unlock(&mapLock);
+
+	return (result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : mapExtent
+// Description  : Takes a new extent from the allocation table for blocks that
+// 		  are already stored, lists it in the reverse index and points the
+// 		  tag directory at it
+//
+// Inputs       : tagNum - the tag number
+// 		  tagBlockNum - the starting block number
+// 		  blks - the number of blocks
+// 		  disk, blockID - the start of the primary copy
+// 		  diskCopy, blockIDCopy - the start of the backup copy
+// Outputs	: the pointer to the extent, or NULL on allocation failure
+
+tableinfo *mapExtent (TagLineNumber tagNum, TagLineBlockNumber tagBlockNum, int blks,
+	RAIDDiskID disk, RAIDBlockID blockID, RAIDDiskID diskCopy, RAIDBlockID blockIDCopy) {
+
+	// Declares variables
+	tableinfo *temp;
+	int i;
+
+	// Takes a new extent from the allocation table
+	if ((temp = newExtent()) == NULL) {
+		return NULL;
+	}
+
+	// Enters data into the extent
+	temp->tagline = tagNum;
+	temp->taglineBlock = tagBlockNum;
+	temp->contiguous = blks;
+	temp->disk = disk;
+	temp->blockID = blockID;
+	temp->diskCopy = diskCopy; 
+	temp->blockIDCopy = blockIDCopy;
+
+	// Lists the extent under both of its disks in the reverse index
+	if (indexExtent(temp) == -1) {
+		return NULL;
+	}
+
+	// Points every block of the extent at it in the tag directory
+	for (i = 0; i < blks; i++) {
+		tagDirectory[(tagNum * MAX_TAGLINE_BLOCK_NUMBER) + tagBlockNum + i] = temp;
+	}
+
+	return temp;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : journalAppend
+// Description  : Appends a record to the allocation map journal, and rewrites
+// 		  the journal as a checkpoint when it has grown too long
+//
+// Inputs       : type - the type of the record
+// 		  a - g - the fields of the record
+// Outputs	: 0 for success, or -1 for failure
+
+int journalAppend (journaltype type, uint32_t a, uint32_t b, uint32_t c, uint32_t d,
+	uint32_t e, uint32_t f, uint32_t g) {
+
+	// Declares local variables
+	journalrecord record;
+
+	record.type = type;
+	record.field[0] = a;
+	record.field[1] = b;
+	record.field[2] = c;
+	record.field[3] = d;
+	record.field[4] = e;
+	record.field[5] = f;
+	record.field[6] = g;
+
+	if (fwrite(&record, sizeof(record), 1, journal) != 1 || fflush(journal) != 0) {
+		logMessage(LOG_ERROR_LEVEL, "The journal could not be written.");
+		return (-1);
+	}
+	journalRecords++;
+
+	// Bounds replay time by compacting the journal every so often. This comes
+	// after the record, which describes a change already made to the map, so
+	// the change is never replayed on top of a checkpoint that holds it.
+	if (journalRecords >= JOURNAL_CHECKPOINT_RECORDS) {
+		if (journalCheckpoint(FALSE) == -1) {
+			logMessage(LOG_ERROR_LEVEL, "The journal could not be written.");
+			return (-1);
+		}
+	}
+
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : journalCheckpoint
+// Description  : Replaces the journal with one that holds just the current
+// 		  allocation map (a header, every extent and every tag's block
+// 		  count), synced to the disk before it replaces the journal,
+// 		  and leaves it open for appending. The checkpoint of a
+// 		  clean close also holds the known block checksums; any other
+// 		  journal leaves them out, as blocks are rewritten in place
+// 		  without a record and their checksums would go stale.
+//
+// Inputs       : closing - TRUE if the driver is closing
+// Outputs	: 0 for success, or -1 for failure
+
+int journalCheckpoint (flag closing) {
+
+	// Declares local variables
+	journalrecord record;
+	tableinfo *temp;
+	FILE *checkpoint;
+	uint32_t i, n;
+
+	if ((checkpoint = fopen(TAGLINE_JOURNAL_FILE ".tmp", "wb")) == NULL) {
+		return (-1);
+	}
+
+	// Writes the header, the extents and the block counts
+	memset(&record, 0, sizeof(record));
+	record.type = JOURNAL_HEADER;
+	record.field[0] = JOURNAL_MAGIC;
+	record.field[1] = maxTaglines;
+	fwrite(&record, sizeof(record), 1, checkpoint);
+
+	for (i = 0; i < (uint32_t) numEntries; i++) {
+		temp = getExtent(i);
+		if (temp->contiguous == 0) continue;
+		record.type = temp->packed ? JOURNAL_PACKED : JOURNAL_EXTENT;
+		record.field[0] = temp->tagline;
+		record.field[1] = temp->taglineBlock;
+		record.field[2] = temp->packed ? temp->packed : temp->contiguous;
+		record.field[3] = temp->disk;
+		record.field[4] = temp->blockID;
+		record.field[5] = temp->diskCopy;
+		record.field[6] = temp->blockIDCopy;
+		fwrite(&record, sizeof(record), 1, checkpoint);
+	}
+
+	memset(&record, 0, sizeof(record));
+	for (i = 0; i < maxTaglines; i++) {
+		if (maxBlockNumAllowed[i] == 0) continue;
+		record.type = JOURNAL_MAXBLOCK;
+		record.field[0] = i;
+		record.field[1] = maxBlockNumAllowed[i];
+		fwrite(&record, sizeof(record), 1, checkpoint);
+	}
+
+	// Writes each run of known checksums of a tag, a few blocks to a record
+	for (i = 0; TAGLINE_CHECKSUM && closing == TRUE && i < MAX_TAGLINE_BLOCK_NUMBER * maxTaglines;
+			i += (n > 0) ? n : 1) {
+		memset(&record, 0, sizeof(record));
+		for (n = 0; n < CHECKSUMS_PER_RECORD && (i % MAX_TAGLINE_BLOCK_NUMBER) + n < MAX_TAGLINE_BLOCK_NUMBER
+				&& checksumKnown(i + n); n++) {
+			record.field[3 + n] = blockChecksums[i + n];
+		}
+		if (n == 0) continue;
+
+		record.type = JOURNAL_CHECKSUM;
+		record.field[0] = i / MAX_TAGLINE_BLOCK_NUMBER;
+		record.field[1] = i % MAX_TAGLINE_BLOCK_NUMBER;
+		record.field[2] = n;
+		fwrite(&record, sizeof(record), 1, checkpoint);
+	}
+
+	// Syncs the checkpoint to the disk before it is swapped in for the old
+	// journal, then syncs the rename, so a crash leaves one or the other
+	if (ferror(checkpoint) || fflush(checkpoint) != 0 || fsync(fileno(checkpoint)) != 0) {
+		fclose(checkpoint);
+		return (-1);
+	}
+	if (fclose(checkpoint) != 0 || rename(TAGLINE_JOURNAL_FILE ".tmp", TAGLINE_JOURNAL_FILE) != 0
+			|| syncJournalDirectory() == -1) {
+		return (-1);
+	}
+	if (journal != NULL) {
+		fclose(journal);
+	}
+	if ((journal = fopen(TAGLINE_JOURNAL_FILE, "ab")) == NULL) {
+		return (-1);
+	}
+	journalRecords = 0;
+
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : syncJournalDirectory
+// Description  : Syncs the directory that holds the journal, which makes the
+// 		  rename of a checkpoint durable
+//
+// Inputs       : none
+// Outputs	: 0 for success, or -1 for failure
+
+int syncJournalDirectory (void) {
+
+	// Declares local variables
+	char path[] = TAGLINE_JOURNAL_FILE, *slash;
+	int dir, result;
+
+	// The directory is the path up to its last slash, or the current one
+	if ((slash = strrchr(path, '/')) == NULL) {
+		strcpy(path, ".");
+	}
+	else if (slash == path) {
+		slash[1] = '\0';
+	}
+	else {
+		slash[0] = '\0';
+	}
+
+	if ((dir = open(path, O_RDONLY)) == -1) {
+		return (-1);
+	}
+	result = fsync(dir);
+	close(dir);
+
+	return ((result == 0) ? 0 : -1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : journalReplay
+// Description  : Rebuilds the allocation map, the tag block counts and the
+// 		  occupancy bitmaps from the journal of a previous run
+//
+// Inputs       : maxlines - the number of taglines the driver was started with
+// Outputs	: 0 for success, or -1 if there is no journal or it does not match
+
+int journalReplay (uint32_t maxlines) {
+
+	// Declares local variables
+	journalrecord record;
+	tableinfo *temp;
+	FILE *replay;
+	uint32_t *f = record.field;
+	uint32_t slot;
+	int i, damaged;
+
+	if ((replay = fopen(TAGLINE_JOURNAL_FILE, "rb")) == NULL) {
+		return (-1);
+	}
+
+	// The journal must have been written for the same number of taglines
+	if (fread(&record, sizeof(record), 1, replay) != 1 || record.type != JOURNAL_HEADER
+			|| f[0] != JOURNAL_MAGIC || f[1] != maxlines) {
+		fclose(replay);
+		return (-1);
+	}
+
+	while (fread(&record, sizeof(record), 1, replay) == 1) {
+		if (record.type == JOURNAL_EXTENT) {
+			if (f[0] >= maxlines || f[1] + f[2] > MAX_TAGLINE_BLOCK_NUMBER
+					|| f[3] >= NUM_DISKS || f[4] + f[2] > DISK_BLOCKS
+					|| f[5] >= NUM_DISKS || f[6] + f[2] > DISK_BLOCKS
+					|| mapExtent(f[0], f[1], f[2], f[3], f[4], f[5], f[6]) == NULL) {
+				break;
+			}
+			markBlocks(f[3], f[4], f[2], TRUE);
+			markBlocks(f[5], f[6], f[2], TRUE);
+			referenceBlocks(f[3], f[4], f[2]);
+		}
+		else if (record.type == JOURNAL_PACKED) {
+			if (f[0] >= maxlines || f[1] >= MAX_TAGLINE_BLOCK_NUMBER
+					|| f[2] == 0 || f[2] > TAGLINE_BLOCK_SIZE
+					|| f[3] >= NUM_DISKS || f[4] >= DISK_BLOCKS
+					|| f[5] >= NUM_DISKS || f[6] >= DISK_BLOCKS
+					|| (temp = mapExtent(f[0], f[1], 1, f[3], f[4], f[5], f[6])) == NULL) {
+				break;
+			}
+			temp->packed = f[2];
+			markBlocks(f[3], f[4], 1, TRUE);
+			markBlocks(f[5], f[6], 1, TRUE);
+			referenceBlocks(f[3], f[4], 1);
+		}
+		else if (record.type == JOURNAL_MAXBLOCK && f[0] < maxlines) {
+			maxBlockNumAllowed[f[0]] = f[1];
+		}
+		else if (record.type == JOURNAL_TRUNCATE && f[0] < maxlines) {
+			trimTag(f[0], f[1]);
+		}
+		else if (record.type == JOURNAL_UNMAP && f[0] < maxlines && f[1] < MAX_TAGLINE_BLOCK_NUMBER) {
+			if (unmapBlock(f[0], f[1]) == -1) {
+				break;
+			}
+		}
+		else if (record.type == JOURNAL_CHECKSUM && f[0] < maxlines && f[2] <= CHECKSUMS_PER_RECORD
+				&& f[1] + f[2] <= MAX_TAGLINE_BLOCK_NUMBER) {
+			for (i = 0; TAGLINE_CHECKSUM && i < (int) f[2]; i++) {
+				slot = (f[0] * MAX_TAGLINE_BLOCK_NUMBER) + f[1] + i;
+				blockChecksums[slot] = f[3 + i];
+				checksumBitmap[slot / BITMAP_WORD_BITS] |= ((uint64_t) 1 << (slot % BITMAP_WORD_BITS));
+			}
+		}
+	}
+
+	damaged = !feof(replay);
+	fclose(replay);
+
+	if (damaged) {
+		// Drops whatever was replayed from a damaged journal
+		for (i = 0; i < NUM_DISKS; i++) {
+			memset(diskBitmap[i], 0, sizeof(diskBitmap[i]));
+			markBlocks(i, DISK_BLOCKS, (BITMAP_WORDS * BITMAP_WORD_BITS) - DISK_BLOCKS, TRUE);
+			diskExtentCount[i] = 0;
+		}
+		memset(tagDirectory, 0, MAX_TAGLINE_BLOCK_NUMBER * maxlines * sizeof(tableinfo *));
+		memset(maxBlockNumAllowed, 0, maxlines * sizeof(int));
+		if (dedupBlocks != NULL) {
+			memset(dedupBlocks, 0, NUM_DISKS * DISK_BLOCKS * sizeof(dedupblock));
+		}
+		if (checksumBitmap != NULL) {
+			memset(checksumBitmap, 0, (MAX_TAGLINE_BLOCK_NUMBER * maxlines) / BITMAP_WORD_BITS * sizeof(uint64_t));
+		}
+		numEntries = 0;
+		numFreeExtents = 0;
+		return (-1);
+	}
+
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : newExtent
+// Description  : Takes a freed extent or the next unused extent from the
+// 		  allocation table, adding a new chunk of extents to the pool when
+// 		  the last one is full
+//
+// Inputs       : none
+// Outputs	: the pointer to the zeroed extent, or NULL on allocation failure
+
+tableinfo *newExtent (void) {
+
+	// Declares local variables
+	tableinfo **chunks, *temp;
+
+	// Reuses a freed extent if there is one
+	if (numFreeExtents > 0) {
+		temp = freeExtents[--numFreeExtents];
+		memset(temp, 0, sizeof(tableinfo));
+		return temp;
+	}
+
+	// Grows the pool by one chunk if every extent is in use
+	if (numEntries == numChunks * EXTENT_CHUNK_SIZE) {
+		chunks = (tableinfo **) realloc(raidtable, (numChunks + 1) * sizeof(tableinfo *));
+		if (!chunks) {
+			return NULL;
+		}
+		raidtable = chunks;
+
+		raidtable[numChunks] = (tableinfo *) malloc(EXTENT_CHUNK_SIZE * sizeof(tableinfo));
+		if (!raidtable[numChunks]) {
+			return NULL;
+		}
+		numChunks++;
+	}
+
+	// Hands out the next extent in the pool
+	temp = getExtent(numEntries++);
+	memset(temp, 0, sizeof(tableinfo));
+	return temp;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : getExtent
+// Description  : Extracts the address of an extent in the allocation table
+//
+// Inputs       : entry - the index of the extent in the table
+// Outputs	: the pointer to the extent
+
+tableinfo *getExtent (int entry) {
+	return &raidtable[entry / EXTENT_CHUNK_SIZE][entry % EXTENT_CHUNK_SIZE];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : indexExtent
+// Description  : Adds an extent to the reverse index lists of its primary and
+// 		  backup disks
+//
+// Inputs       : entry - the extent to index
+// Outputs	: 0 for success, or -1 for failure
+
+int indexExtent (tableinfo *entry) {
+
+	// Declares local variables
+	RAIDDiskID disks[2];
+	tableinfo **list;
+	int i, d;
+
+	disks[0] = entry->disk;
+	disks[1] = entry->diskCopy;
+
+	for (i = 0; i < 2; i++) {
+		d = disks[i];
+
+		// Doubles the disk's list when it is full
+		if (diskExtentCount[d] == diskExtentSize[d]) {
+			list = (tableinfo **) realloc(diskExtents[d],
+				(diskExtentSize[d] ? diskExtentSize[d] * 2 : EXTENT_CHUNK_SIZE) * sizeof(tableinfo *));
+			if (!list) {
+				return (-1);
+			}
+			diskExtents[d] = list;
+			diskExtentSize[d] = diskExtentSize[d] ? diskExtentSize[d] * 2 : EXTENT_CHUNK_SIZE;
+		}
+
+		diskExtents[d][diskExtentCount[d]++] = entry;
+	}
+
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unindexExtent
+// Description  : Removes an extent from the reverse index lists of its primary
+// 		  and backup disks
+//
+// Inputs       : entry - the extent to remove
+// Outputs	: none
+
+void unindexExtent (tableinfo *entry) {
+
+	// Declares local variables
+	RAIDDiskID disks[2];
+	int i, j, d;
+
+	disks[0] = entry->disk;
+	disks[1] = entry->diskCopy;
+
+	// Replaces the extent with the last one of the list
+	for (i = 0; i < 2; i++) {
+		d = disks[i];
+		for (j = 0; j < diskExtentCount[d]; j++) {
+			if (diskExtents[d][j] == entry) {
+				diskExtents[d][j] = diskExtents[d][--diskExtentCount[d]];
+				break;
+			}
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : freeExtent
+// Description  : Gives an extent back to the allocation table. A free extent
+// 		  has no blocks.
+//
+// Inputs       : entry - the extent to free
+// Outputs	: none
+
+void freeExtent (tableinfo *entry) {
+
+	// Declares local variables
+	tableinfo **list;
+
+	entry->contiguous = 0;
+
+	// Doubles the free list when it is full; if that fails the extent is
+	// simply not reused
+	if (numFreeExtents == freeExtentsSize) {
+		list = (tableinfo **) realloc(freeExtents,
+			(freeExtentsSize ? freeExtentsSize * 2 : EXTENT_CHUNK_SIZE) * sizeof(tableinfo *));
+		if (!list) {
+			return;
+		}
+		freeExtents = list;
+		freeExtentsSize = freeExtentsSize ? freeExtentsSize * 2 : EXTENT_CHUNK_SIZE;
+	}
+
+	freeExtents[numFreeExtents++] = entry;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : trimTag
+// Description  : Cuts a tag down to a number of blocks. The blocks past the new
+// 		  end are unmapped, returned to the occupancy bitmaps and dropped
+// 		  from the cache and the write coalescing buffer; extents that lie
+// 		  wholly past the end are freed and the one across it is shortened.
+// 		  A rebuild in progress goes on in the background: releaseBlocks
+// 		  keeps the freed blocks from being reused until it is done.
+// 		  Called with the tag's lock, the rebuild lock for writing and the
+// 		  map lock held.
+//
+// Inputs       : tag - the tag number
+// 		  nblocks - the number of blocks to keep
+// Outputs	: 0 for success, or -1 for failure
+
+int trimTag (TagLineNumber tag, TagLineBlockNumber nblocks) {
+
+	// Declares local variables
+	tableinfo *temp;
+	TagLineBlockNumber bnum;
+	int offset, length, i;
+	pendingwrite *run = &pending[TAG_SHARD(tag)];
+
+	// Ends any sequential scan of the tag, whose window may cover blocks
+	// that are about to go
+	readahead[tag].next = MAX_TAGLINE_BLOCK_NUMBER;
+	readahead[tag].prefetched = 0;
+	readahead[tag].window = 0;
+
+	// Drops the coalesced blocks past the new end, with any failure to
+	// write them
+	if (run->blocks > 0 && run->tag == tag) {
+		if (run->start >= nblocks) {
+			run->blocks = 0;
+			flushFailed[tag] = 0;
+		}
+		else if (run->start + run->blocks > nblocks) {
+			run->blocks = nblocks - run->start;
+		}
+	}
+
+	for (bnum = nblocks; bnum < (TagLineBlockNumber) maxBlockNumAllowed[tag]; bnum += length) {
+		if ((temp = getTagEntry(tag, bnum)) == NULL) {
+			length = 1;
+			continue;
+		}
+
+		// Frees the rest of the extent from this block on
+		offset = bnum - temp->taglineBlock;
+		length = temp->contiguous - offset;
+
+		releaseBlocks(temp->disk, temp->blockID + offset, temp->diskCopy,
+			temp->blockIDCopy + offset, length);
+
+		for (i = 0; i < length; i++) {
+			tagDirectory[(tag * MAX_TAGLINE_BLOCK_NUMBER) + bnum + i] = NULL;
+		}
+
+		if (offset == 0) {
+			unindexExtent(temp);
+			freeExtent(temp);
+		}
+		else {
+			temp->contiguous = offset;
+		}
+	}
+
+	// Forgets the cached blocks and the checksums of the blocks cut off
+	if (nblocks < (TagLineBlockNumber) maxBlockNumAllowed[tag]) {
+		invalidate_raid_cache(tag, nblocks, maxBlockNumAllowed[tag] - nblocks);
+		setChecksums(tag, nblocks, maxBlockNumAllowed[tag] - nblocks, NULL);
+		maxBlockNumAllowed[tag] = nblocks;
+	}
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : planRebuild
+// Description  : Starts the rebuild of a formatted disk. The extents of the disk
+// 		  are taken from the reverse index, sorted by block on the failed
+// 		  disk into the copy plan, and every block they cover is marked stale.
+//
+// Inputs       : diskFailed - the disk to rebuild
+// Outputs	: 0 for success, or -1 for failure
+
+int planRebuild (RAIDDiskID diskFailed) {
+
+	// Declares local variables
+	tableinfo *temp;
+	int i, n;
+
+	memset(staleBitmap, 0, sizeof(staleBitmap));
+	rebuildCount = 0;
+	rebuildCursor = 0;
+
+	if (diskExtentCount[diskFailed] == 0) {
+		return (0);
+	}
+
+	rebuildPlan = (rebuildcopy *) malloc(diskExtentCount[diskFailed] * sizeof(rebuildcopy));
+	if (!rebuildPlan) {
+		logMessage(LOG_ERROR_LEVEL, "Memory allocation failed.");
+		return (-1);
+	}
+
+	// Lists the copy needed for every extent of the failed disk
+	for (i = 0; i < diskExtentCount[diskFailed]; i++) {
+		temp = diskExtents[diskFailed][i];
+		if (temp->disk == diskFailed) {
+			rebuildPlan[i].target = temp->blockID;
+			rebuildPlan[i].source = temp->diskCopy;
+			rebuildPlan[i].sourceBlock = temp->blockIDCopy;
+		}
+		else {
+			rebuildPlan[i].target = temp->blockIDCopy;
+			rebuildPlan[i].source = temp->disk;
+			rebuildPlan[i].sourceBlock = temp->blockID;
+		}
+		rebuildPlan[i].blocks = temp->contiguous;
+	}
+
+	// Sorts the copies by target block, drops any duplicates and marks them stale
+	qsort(rebuildPlan, diskExtentCount[diskFailed], sizeof(rebuildcopy), compareRebuildCopies);
+	for (i = 1, n = 1; i < diskExtentCount[diskFailed]; i++) {
+		if (rebuildPlan[i].target != rebuildPlan[n - 1].target) {
+			rebuildPlan[n++] = rebuildPlan[i];
+		}
+	}
+	for (i = 0; i < n; i++) {
+		markStale(rebuildPlan[i].target, rebuildPlan[i].blocks, TRUE);
+	}
+
+	rebuildCount = n;
+	rebuildTarget = diskFailed;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : rebuildSlice
+// Description  : Continues the rebuild in progress from the rebuild cursor,
+// 		  copying runs of up to RAID_MAX_XFER blocks until at least maxBlocks
+// 		  blocks have been restored. Every source range that is contiguous
+// 		  is read with one request, and each run is written with one request.
+//
+// Inputs       : maxBlocks - the number of blocks to restore before returning
+// Outputs	: 0 for success, or -1 for failure
+
+int rebuildSlice (int maxBlocks) {
+
+	// Declares local variables
+	RAIDOpCode response;
+	RAIDBlockID start;
+	int arr[RAID_OPCODE_MAXVAL] = {0};
+	int i, j, k, m, run, length, done = 0;
+
+	if (rebuildTarget == -1) {
+		return (0);
+	}
+
+	for (i = rebuildCursor; i < rebuildCount && done < maxBlocks; i = j) {
+		// Gathers the copies that continue the run on the rebuilt disk
+		start = rebuildPlan[i].target;
+		run = 0;
+		for (j = i; j < rebuildCount && rebuildPlan[j].target == start + run
+				&& run + rebuildPlan[j].blocks <= RAID_MAX_XFER; j++) {
+			run += rebuildPlan[j].blocks;
+		}
+
+		// Reads the run from the surviving disks, one request per contiguous source range
+		for (k = i; k < j; k = m) {
+			length = rebuildPlan[k].blocks;
+			for (m = k + 1; m < j && rebuildPlan[m].source == rebuildPlan[k].source
+					&& rebuildPlan[m].sourceBlock == rebuildPlan[k].sourceBlock + length; m++) {
+				length += rebuildPlan[m].blocks;
+			}
+
+			response = create_raid_request(RAID_READ, length, rebuildPlan[k].source, 0, 0,
+				rebuildPlan[k].sourceBlock,
+				&failureBuf[(rebuildPlan[k].target - start) * RAID_BLOCK_SIZE]);
+			extract_raid_response(response, arr, RAID_OPCODE_MAXVAL);
+			if (arr[RAID_OPCODE_STATUS] == 1) {
+				logMessage(LOG_ERROR_LEVEL, "A RAID command failed.");
+				return (-1);
+			}
+		}
+
+		// Writes the whole run to the rebuilt disk, which makes it current
+		response = create_raid_request(RAID_WRITE, run, rebuildTarget, 0, 0, start, failureBuf);
+		extract_raid_response(response, arr, RAID_OPCODE_MAXVAL);
+		if (arr[RAID_OPCODE_STATUS] == 1) {
+			logMessage(LOG_ERROR_LEVEL, "A RAID command failed.");
+			return (-1);
+		}
+		markStale(start, run, FALSE);
+
+		done += run;
+		rebuildCursor = j;
+	}
+
+	// Leaves degraded mode once the last copy is done
+	if (rebuildCursor == rebuildCount) {
+		logMessage(LOG_INFO_LEVEL, "TAGLINE rebuilt disk %d.", rebuildTarget);
+		free(rebuildPlan);
+		rebuildPlan = NULL;
+		rebuildTarget = -1;
+		releaseDeferredBlocks();
+	}
+
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : advanceRebuild
+// Description  : Runs a slice of the rebuild in progress, if any, with every
+// 		  request kept out
+//
+// Inputs       : maxBlocks - the number of blocks to restore before returning
+// Outputs	: 0 for success, or -1 for failure
+
+int advanceRebuild (int maxBlocks) {
+
+	// Declares local variables
+	int result;
+
+	if (rebuildTarget == -1) {
+		return (0);
+	}
+
+	pthread_rwlock_wrlock(&rebuildLock);
+	result = rebuildSlice(maxBlocks);
+	pthread_rwlock_unlock(&rebuildLock);
+
+	return (result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : isStale
+// Description  : Tells whether a range of blocks is waiting to be rebuilt
+//
+// Inputs       : disk - the disk of the blocks
+// 		  blockID - the first block
+// 		  blks - the number of blocks
+// Outputs	: 1 if any block of the range is stale, 0 otherwise
+
+int isStale (RAIDDiskID disk, RAIDBlockID blockID, int blks) {
+
+	// Declares local variables
+	int i;
+
+	if ((int) disk != rebuildTarget) {
+		return (0);
+	}
+
+	for (i = 0; i < blks; i++) {
+		if (staleBitmap[(blockID + i) / BITMAP_WORD_BITS] & (1ULL << ((blockID + i) % BITMAP_WORD_BITS))) {
+			return (1);
+		}
+	}
+
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : markStale
+// Description  : Sets or clears the stale bits of a range of the rebuilt disk
+//
+// Inputs       : blockID - the first block
+// 		  blks - the number of blocks
+// 		  stale - TRUE to mark the blocks stale, FALSE once they are current
+// Outputs	: none
+
+void markStale (RAIDBlockID blockID, int blks, flag stale) {
+
+	// Declares local variables
+	int i;
+
+	for (i = 0; i < blks; i++) {
+		if (stale == TRUE) {
+			staleBitmap[(blockID + i) / BITMAP_WORD_BITS] |= (1ULL << ((blockID + i) % BITMAP_WORD_BITS));
+		}
+		else {
+			staleBitmap[(blockID + i) / BITMAP_WORD_BITS] &= ~(1ULL << ((blockID + i) % BITMAP_WORD_BITS));
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : compareRebuildCopies
+// Description  : Orders rebuild copies by their block on the failed disk
+//
+// Inputs       : a, b - the copies to compare
+// Outputs	: negative, zero or positive as a is before, equal to or after b
+
+int compareRebuildCopies (const void *a, const void *b) {
+
+	// Declares local variables
+	RAIDBlockID x = ((const rebuildcopy *) a)->target;
+	RAIDBlockID y = ((const rebuildcopy *) b)->target;
+
+	return (x > y) - (x < y);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : getTagEntry
+// Description  : Extracts the address of the entry with the tagline number and 
+// 		  tagline block number combination in the table, if it exists.
+// 		  The lookup is a direct index into the tag directory.
+//
+// Inputs       : tagNum - the tagline number to examine
+//		  tagBlockNum - the tagline block number to examine 
+// Outputs	: the pointer to the entry, or NULL if it does not exist
+
+void* getTagEntry (TagLineNumber tagNum, TagLineBlockNumber tagBlockNum){
+
+	// Returns NULL if the combination is outside of the tag directory
+	if (tagNum >= maxTaglines || tagBlockNum >= MAX_TAGLINE_BLOCK_NUMBER) {
+		return NULL;
+	}
+
+	// Returns the address of the entry, or NULL if the slot is empty
+	return tagDirectory[(tagNum * MAX_TAGLINE_BLOCK_NUMBER) + tagBlockNum];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : getRAIDEntry
+// Description  : Extracts the address of the entry with the RAID disk number and block
+// 		  ID combination, if it exists
+//
+// Inputs       : diskNum - the tagline number to examine
+//		  blockIDNum - the tagline block number to examine 
+// Outputs	: the pointer to the entry, or NULL if it does not exist
+
+void* getRAIDEntry (RAIDDiskID diskNum, RAIDBlockID blockIDNum){
+
+	// Declares local variables
+	int entry;
+	tableinfo *temp; 
+
+	// Searches the allocation table for an extent covering the RAID disk number
+	// and block ID combination
+	for (entry = 0; entry < numEntries; entry++) {
+		temp = getExtent(entry);
+		if (temp->disk == diskNum && blockIDNum >= temp->blockID &&
+			blockIDNum < temp->blockID + temp->contiguous) return temp;
+		if (temp->diskCopy == diskNum && blockIDNum >= temp->blockIDCopy &&
+			blockIDNum < temp->blockIDCopy + temp->contiguous) return temp;
+	}
+
+
+	// Returns NULL
+	return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : allocateBlocks
+// Description  : Reserves a contiguous range of free blocks on a disk, trying
+// 		  each disk in turn starting from the given one
+//
+// Inputs       : firstDisk - the first disk to try
+// 		  excludeDisk - a disk that must not be used (NUM_DISKS for none)
+// 		  blks - the number of blocks to reserve
+// 		  disk - set to the disk of the reserved range
+// 		  block - set to the first block of the reserved range
+// Outputs	: 0 for success, or -1 if no disk has enough contiguous space
+
+int allocateBlocks (RAIDDiskID firstDisk, RAIDDiskID excludeDisk, uint8_t blks,
+	RAIDDiskID *disk, RAIDBlockID *block) {
+
+	// Declares local variables
+	int i;
+	RAIDDiskID candidate;
+
+	// Searches the disks in order, marking the first free range found as used
+	for (i = 0; i < NUM_DISKS; i++) {
+		candidate = (firstDisk + i) % NUM_DISKS;
+		if (candidate == excludeDisk) continue;
+
+		if (findFreeBlocks(candidate, blks, block) == 0) {
+			markBlocks(candidate, *block, blks, TRUE);
+			*disk = candidate;
+			return (0);
+		}
+	}
+
+	return (-1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : findFreeBlocks
+// Description  : Finds a run of free blocks on a disk by scanning its occupancy
+// 		  bitmap a word at a time, starting from the disk's next-fit cursor.
+// 		  Full words are skipped and empty words add 64 blocks at once,
+// 		  so the search is bounded by the size of the bitmap.
+//
+// Inputs       : disk - the disk to search
+// 		  blks - the number of contiguous blocks needed
+// 		  start - set to the first block of the run
+// Outputs	: 0 for success, or -1 if there is no such run
+
+int findFreeBlocks (RAIDDiskID disk, uint8_t blks, RAIDBlockID *start) {
+
+	// Declares local variables
+	int i, w, pos, count, run = 0;
+	uint64_t word, rest;
+	RAIDBlockID runStart = 0;
+
+	for (i = 0; i <= BITMAP_WORDS; i++) {
+		// Wraps around to the start of the disk once; runs cannot span the wrap
+		w = (diskCursor[disk] + i) % BITMAP_WORDS;
+		if (w == 0) run = 0;
+		word = diskBitmap[disk][w];
+
+		// Skips words that are completely allocated
+		if (word == BITMAP_FULL_WORD) {
+			run = 0;
+			continue;
+		}
+
+		// Walks the word one run of free or used bits at a time
+		pos = 0;
+		while (pos < BITMAP_WORD_BITS) {
+			rest = word >> pos;
+			if ((rest & 1) == 0) {
+				// Counts the free bits from the current position
+				count = (rest == 0) ? BITMAP_WORD_BITS - pos : __builtin_ctzll(rest);
+				if (run == 0) runStart = (w * BITMAP_WORD_BITS) + pos;
+				run += count;
+				if (run >= blks) {
+					*start = runStart;
+					diskCursor[disk] = (runStart + blks) / BITMAP_WORD_BITS % BITMAP_WORDS;
+					return (0);
+				}
+			}
+			else {
+				// Counts the used bits from the current position
+				count = (~rest == 0) ? BITMAP_WORD_BITS - pos : __builtin_ctzll(~rest);
+				run = 0;
+			}
+			pos += count;
+		}
+	}
+
+	return (-1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : markBlocks
+// Description  : Marks a range of blocks on a disk as used or free in the
+// 		  occupancy bitmap
+//
+// Inputs       : disk - the disk of the range
+// 		  start - the first block of the range
+// 		  blks - the number of blocks in the range
+// 		  used - TRUE to mark the blocks used, FALSE to mark them free
+
+void markBlocks (RAIDDiskID disk, RAIDBlockID start, int blks, flag used) {
+
+	// Declares local variables
+	int i;
+	RAIDBlockID blk;
+
+	for (i = 0; i < blks; i++) {
+		blk = start + i;
+		if (used == TRUE) {
+			diskBitmap[disk][blk / BITMAP_WORD_BITS] |= ((uint64_t) 1 << (blk % BITMAP_WORD_BITS));
+		}
+		else {
+			diskBitmap[disk][blk / BITMAP_WORD_BITS] &= ~((uint64_t) 1 << (blk % BITMAP_WORD_BITS));
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : submitRequest
+// Description  : Adds a request to the submission ring and wakes a worker
+//
+// Inputs       : type - ASYNC_READ, ASYNC_WRITE or ASYNC_PREFETCH
+//                tag, bnum, blks, buf - the arguments of the read or write
+//                done - the function to call when the request finishes, or NULL
+//                arg - passed to done or returned with the completion
+// Outputs      : the request handle, or -1 if the request could not be queued
+
+TagLineRequest submitRequest (asynctype type, TagLineNumber tag, TagLineBlockNumber bnum,
+		uint8_t blks, char *buf, TagLineCallback done, void *arg) {
+
+	// Declares local variables
+	asyncrequest *request;
+	TagLineRequest id;
+	int used;
+
+	pthread_mutex_lock(&asyncLock);
+	if (asyncWorkerCount == 0 || asyncStopping == TRUE) {
+		pthread_mutex_unlock(&asyncLock);
+		logMessage(LOG_ERROR_LEVEL, "The driver is not accepting requests.");
+		return (-1);
+	}
+
+	// Every queued, running and unreaped request holds one slot. Readahead is
+	// only queued while fewer than READAHEAD_QUEUE_LIMIT slots are held, so
+	// the rest of the slots stay free for submitted requests.
+	used = asyncQueued + asyncRunning + doneCount;
+	if (used == ASYNC_QUEUE_DEPTH || (type == ASYNC_PREFETCH && used >= READAHEAD_QUEUE_LIMIT)) {
+		pthread_mutex_unlock(&asyncLock);
+		return (-1);
+	}
+
+	id = nextRequest;
+	nextRequest = (nextRequest + 1) & INT32_MAX;
+
+	request = &asyncQueue[(asyncHead + asyncQueued) % ASYNC_QUEUE_DEPTH];
+	request->id = id;
+	request->type = type;
+	request->tag = tag;
+	request->bnum = bnum;
+	request->blks = blks;
+	request->buf = buf;
+	request->done = done;
+	request->arg = arg;
+	asyncQueued++;
+
+	pthread_cond_signal(&asyncSubmitted);
+	pthread_mutex_unlock(&asyncLock);
+
+	return (id);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : asyncWorker
+// Description  : Runs submitted requests until the driver closes. Every
+//                COALESCE_TIMEOUT_USEC one worker also writes out the coalesced
+//                runs that have waited too long, so they reach RAID even if no
+//                other request comes to their shard.
+//
+// Inputs       : unused - not used
+// Outputs      : NULL
+
+void *asyncWorker (void *unused) {
+
+	// Declares local variables
+	asyncrequest request;
+	TagLineCompletion *completion;
+	struct timespec deadline;
+	int status;
+
+	pthread_mutex_lock(&asyncLock);
+	for (;;) {
+		if (asyncStopping == FALSE && coalesceDue(&deadline)) {
+			pthread_mutex_unlock(&asyncLock);
+			flushStaleWrites();
+			pthread_mutex_lock(&asyncLock);
+		}
+
+		// Waits for a request until the next sweep is due
+		if (asyncQueued == 0 && asyncStopping == FALSE) {
+			pthread_cond_timedwait(&asyncSubmitted, &asyncLock, &deadline);
+			continue;
+		}
+		if (asyncQueued == 0) {
+			break;
+		}
+
+		// Takes the oldest request and runs it without the lock
+		request = asyncQueue[asyncHead];
+		asyncHead = (asyncHead + 1) % ASYNC_QUEUE_DEPTH;
+		asyncQueued--;
+		asyncRunning++;
+		pthread_mutex_unlock(&asyncLock);
+
+		if (request.type == ASYNC_READ) {
+			status = tagline_read(request.tag, request.bnum, request.blks, request.buf);
+		}
+		else if (request.type == ASYNC_WRITE) {
+			status = tagline_write(request.tag, request.bnum, request.blks, request.buf);
+		}
+		else {
+			status = prefetchTag(request.tag, request.bnum, request.blks);
+		}
+		if (request.done != NULL) {
+			request.done(request.id, status, request.arg);
+		}
+
+		// Reports the completion unless the callback already did or the
+		// request was the driver's own readahead
+		pthread_mutex_lock(&asyncLock);
+		if (request.done == NULL && request.type != ASYNC_PREFETCH) {
+			completion = &asyncDone[(doneHead + doneCount) % ASYNC_QUEUE_DEPTH];
+			completion->request = request.id;
+			completion->status = status;
+			completion->arg = request.arg;
+			doneCount++;
+		}
+		asyncRunning--;
+		pthread_cond_broadcast(&asyncFinished);
+	}
+	pthread_mutex_unlock(&asyncLock);
+
+	return (NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : coalesceDue
+// Description  : Tells a worker whether the coalesced runs are due to be
+//                checked for a timeout, and if so claims the sweep so the
+//                other workers leave it. Called with the async lock held.
+//
+// Inputs       : deadline - set to when the next sweep is due
+// Outputs      : 1 if the caller is to sweep, 0 otherwise
+
+int coalesceDue (struct timespec *deadline) {
+
+	// Declares local variables
+	struct timeval now;
+	long usec;
+	int due = 0;
+
+	gettimeofday(&now, NULL);
+	if (((now.tv_sec - coalesceSwept.tv_sec) * 1000000) +
+			(now.tv_usec - coalesceSwept.tv_usec) >= COALESCE_TIMEOUT_USEC) {
+		coalesceSwept = now;
+		due = 1;
+	}
+
+	usec = coalesceSwept.tv_usec + COALESCE_TIMEOUT_USEC;
+	deadline->tv_sec = coalesceSwept.tv_sec + usec / 1000000;
+	deadline->tv_nsec = (usec % 1000000) * 1000;
+
+	return (due);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : flushStaleWrites
+// Description  : Writes out the coalesced run of every shard that has waited
+//                longer than COALESCE_TIMEOUT_USEC. A failure is recorded
+//                against the run's tag.
+//
+// Inputs       : none
+// Outputs      : none
+
+void flushStaleWrites (void) {
+
+	// Declares local variables
+	int i;
+
+	for (i = 0; i < TAG_LOCK_SHARDS; i++) {
+		pthread_mutex_lock(&tagLocks[i]);
+		pthread_rwlock_rdlock(&rebuildLock);
+		checkPendingWrite(&pending[i]);
+		pthread_rwlock_unlock(&rebuildLock);
+		pthread_mutex_unlock(&tagLocks[i]);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : startWorkers
+// Description  : Empties the request rings and starts the worker threads
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int startWorkers (void) {
+
+	// Declares local variables
+	int i;
+
+	asyncHead = 0;
+	asyncQueued = 0;
+	asyncRunning = 0;
+	doneHead = 0;
+	doneCount = 0;
+	nextRequest = 0;
+	asyncStopping = FALSE;
+	gettimeofday(&coalesceSwept, NULL);
+
+	for (asyncWorkerCount = 0; asyncWorkerCount < ASYNC_WORKERS; asyncWorkerCount++) {
+		if (pthread_create(&asyncWorkers[asyncWorkerCount], NULL, asyncWorker, NULL) != 0) {
+			break;
+		}
+	}
+
+	// Runs with fewer threads if some could not be created
+	if (asyncWorkerCount == 0) {
+		return (-1);
+	}
+	for (i = asyncWorkerCount; i < ASYNC_WORKERS; i++) {
+		logMessage(LOG_WARNING_LEVEL, "Request thread %d could not be started.", i);
+	}
+
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stopWorkers
+// Description  : Waits for every submitted request to finish, then stops the
+//                worker threads. Completions that were never reaped are dropped.
+//
+// Inputs       : none
+// Outputs      : none
+
+void stopWorkers (void) {
+
+	// Declares local variables
+	int i;
+
+	pthread_mutex_lock(&asyncLock);
+	while (asyncQueued + asyncRunning > 0) {
+		pthread_cond_wait(&asyncFinished, &asyncLock);
+	}
+	asyncStopping = TRUE;
+	pthread_cond_broadcast(&asyncSubmitted);
+	pthread_mutex_unlock(&asyncLock);
+
+	for (i = 0; i < asyncWorkerCount; i++) {
+		pthread_join(asyncWorkers[i], NULL);
+	}
+	asyncWorkerCount = 0;
+	doneCount = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lockVectors
+// Description  : Takes the locks of the tags of a vectored request, in shard
+//                order so that batches never wait on each other in a cycle
+//
+// Inputs       : vec - the ranges of the request
+//                count - the number of ranges
+// Outputs      : the set of shards locked, one bit per shard
+
+uint32_t lockVectors (TagLineVector *vec, int count) {
+
+	// Declares local variables
+	uint32_t shards = 0;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		shards |= (uint32_t) 1 << TAG_SHARD(vec[i].tag);
+	}
+	for (i = 0; i < TAG_LOCK_SHARDS; i++) {
+		if (shards & ((uint32_t) 1 << i)) {
+			pthread_mutex_lock(&tagLocks[i]);
+		}
+	}
+
+	return (shards);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unlockVectors
+// Description  : Releases the locks taken by lockVectors
+//
+// Inputs       : shards - the set of shards locked
+// Outputs      : none
+
+void unlockVectors (uint32_t shards) {
+
+	// Declares local variables
+	int i;
+
+	for (i = TAG_LOCK_SHARDS - 1; i >= 0; i--) {
+		if (shards & ((uint32_t) 1 << i)) {
+			pthread_mutex_unlock(&tagLocks[i]);
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : readVectors
+// Description  : Reads the ranges of a vectored read. Called with the locks of
+//                its tags held and the rebuild lock held for reading.
+//
+// Inputs       : vec - the ranges to read
+//                count - the number of ranges
+// Outputs      : 0 if successful, -1 if failure
+
+int readVectors (TagLineVector *vec, int count) {
+
+	// Declares local variables
+	vectorplan plan;
+	tableinfo *temp;
+	pendingwrite *run;
+	RAIDDiskID readDisk;
+	RAIDBlockID readBlock;
+	char *buf;
+	int i, j, k, done, reading, offset, result = 0;
+
+	// Makes sure every range exists, and writes out the coalesced blocks that
+	// have waited too long or that the batch reads
+	for (i = 0; i < count; i++) {
+		if (vec[i].bnum + vec[i].blks > tagLength(vec[i].tag)) {
+			return (-1);
+		}
+		run = &pending[TAG_SHARD(vec[i].tag)];
+		checkPendingWrite(run);
+		if (run->blocks > 0 && run->tag == vec[i].tag && vec[i].bnum < run->start + run->blocks
+				&& vec[i].bnum + vec[i].blks > run->start) {
+			flushPendingWrite(run);
+		}
+		if (takeFlushError(vec[i].tag) == -1) {
+			return (-1);
+		}
+	}
+
+	// Serves the cached blocks from memory and plans a read of each run of
+	// missed blocks from whichever copy is cheaper to read
+	memset(&plan, 0, sizeof(plan));
+	for (i = 0; i < count && result == 0; i++) {
+		for (done = 0; done < vec[i].blks && result == 0; done += reading) {
+			if ((temp = getTagEntry(vec[i].tag, vec[i].bnum + done)) == NULL) {
+				logMessage(LOG_ERROR_LEVEL, "Tag entry does not exist. Bye bye!");
+				result = -1;
+				break;
+			}
+			offset = vec[i].bnum + done - temp->taglineBlock;
+			reading = temp->contiguous - offset;
+			if (reading > vec[i].blks - done) reading = vec[i].blks - done;
+			buf = &vec[i].buf[done * TAGLINE_BLOCK_SIZE];
+
+			// Decompresses a packed block through the copying read path
+			if (temp->packed) {
+				result = readTag(vec[i].tag, vec[i].bnum + done, 1, buf);
+				continue;
+			}
+
+			for (j = 0; j < reading; j = k) {
+				if (copy_raid_cache(vec[i].tag, vec[i].bnum + done + j, &buf[j * TAGLINE_BLOCK_SIZE]) == 0) {
+					hits++;
+					k = j + 1;
+					continue;
+				}
+
+				// Extends the run over the following missed blocks
+				misses++;
+				for (k = j + 1; k < reading && copy_raid_cache(vec[i].tag, vec[i].bnum + done + k,
+						&buf[k * TAGLINE_BLOCK_SIZE]) == -1; k++) {
+					misses++;
+				}
+				selectReplica(temp, offset + j, k - j, &readDisk, &readBlock);
+				if (addVectorRange(&plan, readDisk, readBlock, k - j, &buf[j * TAGLINE_BLOCK_SIZE],
+						1, vec[i].tag, vec[i].bnum + done + j) == -1) {
+					result = -1;
+					break;
+				}
+				if (k < reading) {
+					hits++;
+					k++;
+				}
+			}
+		}
+	}
+
+	// Reads the planned ranges; if a disk has failed under the batch, reads the
+	// ranges one at a time instead, which reads around the failed disk
+	if (result == 0 && runVectorPlan(&plan, RAID_READ) == -1) {
+		result = -1;
+		if (refreshDiskStates() == 0) {
+			for (i = 0; i < NUM_DISKS && diskState[i] != RAID_DISK_FAILED; i++);
+			if (i < NUM_DISKS) {
+				for (result = 0, j = 0; j < count && result == 0; j++) {
+					result = readTag(vec[j].tag, vec[j].bnum, vec[j].blks, vec[j].buf);
+				}
+			}
+		}
+	}
+	else if (result == 0) {
+		// Checks the batch against its checksums. If a block fails, nothing of
+		// the batch is cached and it is read again range by range, which reads
+		// around the bad copy.
+		for (i = 0; TAGLINE_CHECKSUM && i < count &&
+				verifyBlocks(vec[i].tag, vec[i].bnum, vec[i].blks, vec[i].buf) == 0; i++);
+		if (TAGLINE_CHECKSUM && i < count) {
+			for (j = 0; j < count && result == 0; j++) {
+				result = readTag(vec[j].tag, vec[j].bnum, vec[j].blks, vec[j].buf);
+			}
+		}
+		else {
+			// Caches the blocks read only once every buffer is complete, as each
+			// insert may evict (and write back) another block of the batch
+			for (i = 0; i < plan.count; i++) {
+				put_raid_cache_blocks(plan.ranges[i].cacheTag, plan.ranges[i].cacheBlock,
+					plan.ranges[i].blocks, plan.ranges[i].buf);
+			}
+		}
+	}
+
+	free(plan.ranges);
+	free(plan.scratch);
+
+	if (result == 0) {
+		logMessage(LOG_INFO_LEVEL, "TAGLINE : read %d ranges as a batch.", count);
+	}
+	return (result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : writeVectors
+// Description  : Writes the ranges of a vectored write. Called with the locks
+//                of its tags held and the rebuild lock held for reading.
+//
+// Inputs       : vec - the ranges to write
+//                count - the number of ranges
+// Outputs      : 0 if successful, -1 if failure
+
+int writeVectors (TagLineVector *vec, int count) {
+
+	// Declares local variables
+	vectorplan plan;
+	tableinfo *temp, *added;
+	pendingwrite *run;
+	RAIDDiskID firstDisk, firstCopyDisk, newDisk, backupDisk;
+	RAIDBlockID newRAIDBlock, backupRAIDBlock;
+	TagLineNumber tag;
+	TagLineBlockNumber bnum, length;
+	int i, k, blks, written, offset, writing, planStart = 0, result = 0;
+
+	// Writes out the coalesced blocks of the batch's tags so the map is current
+	for (i = 0; i < count; i++) {
+		run = &pending[TAG_SHARD(vec[i].tag)];
+		if (run->blocks > 0 && run->tag == vec[i].tag) {
+			flushPendingWrite(run);
+		}
+		if (takeFlushError(vec[i].tag) == -1) {
+			return (-1);
+		}
+	}
+
+	// New blocks of the batch start their search on the same pair of disks
+	firstDisk = rand() % NUM_DISKS;
+	firstCopyDisk = (firstDisk + 1 + (rand() % (NUM_DISKS - 1))) % NUM_DISKS;
+
+	memset(&plan, 0, sizeof(plan));
+	for (i = 0; i < count && result == 0; i++) {
+		tag = vec[i].tag;
+		bnum = vec[i].bnum;
+		blks = vec[i].blks;
+
+		// Makes sure the starting block number does not exceed the max block
+		// number, counting the blocks that earlier ranges of the batch add
+		length = maxBlockNumAllowed[tag];
+		for (k = 0; k < i; k++) {
+			if (vec[k].tag == tag && vec[k].bnum + vec[k].blks > length) {
+				length = vec[k].bnum + vec[k].blks;
+			}
+		}
+		if (bnum > length || bnum + blks > MAX_TAGLINE_BLOCK_NUMBER) {
+			result = -1;
+			break;
+		}
+
+		// A range that overlaps an earlier range of the plan is applied after it
+		for (k = planStart; k < i; k++) {
+			if (vec[k].tag == tag && bnum < vec[k].bnum + vec[k].blks && bnum + blks > vec[k].bnum) {
+				break;
+			}
+		}
+		if (k < i) {
+			if (runWritePlan(&plan) == -1) {
+				result = -1;
+				break;
+			}
+			planStart = i;
+		}
+
+		// Deduplicated or compressed blocks may each be remapped, so they are
+		// written range by range instead of being planned
+		written = 0;
+		if (TAGLINE_DEDUP || TAGLINE_COMPRESS) {
+			result = writeBlocks(tag, bnum, blks, vec[i].buf);
+			written = blks;
+		}
+
+		// Plans the overwrite of the blocks that are already mapped
+		while (written < blks && result == 0 && (temp = getTagEntry(tag, bnum + written)) != NULL) {
+			offset = bnum + written - temp->taglineBlock;
+			writing = temp->contiguous - offset;
+			if (writing > blks - written) writing = blks - written;
+
+			result = addWriteRanges(&plan, tag, bnum + written, temp->disk, temp->blockID + offset,
+				temp->diskCopy, temp->blockIDCopy + offset, writing,
+				&vec[i].buf[written * TAGLINE_BLOCK_SIZE]);
+			written += writing;
+		}
+
+		// Allocates the remaining new blocks as one extent, mapped once stored
+		if (written < blks && result == 0) {
+			pthread_mutex_lock(&mapLock);
+			if (allocateBlocks(firstDisk, NUM_DISKS, blks - written, &newDisk, &newRAIDBlock) == -1) {
+				pthread_mutex_unlock(&mapLock);
+				logMessage(LOG_ERROR_LEVEL, "No free RAID blocks for the primary copy.");
+				result = -1;
+				break;
+			}
+			if (allocateBlocks(firstCopyDisk, newDisk, blks - written, &backupDisk, &backupRAIDBlock) == -1) {
+				markBlocks(newDisk, newRAIDBlock, blks - written, FALSE);
+				pthread_mutex_unlock(&mapLock);
+				logMessage(LOG_ERROR_LEVEL, "No free RAID blocks for the backup copy.");
+				result = -1;
+				break;
+			}
+			pthread_mutex_unlock(&mapLock);
+
+			if (plan.addedCount == plan.addedSize) {
+				added = (tableinfo *) realloc(plan.added, (plan.addedSize + 16) * sizeof(tableinfo));
+				if (added == NULL) {
+					pthread_mutex_lock(&mapLock);
+					markBlocks(newDisk, newRAIDBlock, blks - written, FALSE);
+					markBlocks(backupDisk, backupRAIDBlock, blks - written, FALSE);
+					pthread_mutex_unlock(&mapLock);
+					logMessage(LOG_ERROR_LEVEL, "Memory allocation failed.");
+					result = -1;
+					break;
+				}
+				plan.added = added;
+				plan.addedSize += 16;
+			}
+			added = &plan.added[plan.addedCount++];
+			added->tagline = tag;
+			added->taglineBlock = bnum + written;
+			added->contiguous = blks - written;
+			added->disk = newDisk;
+			added->blockID = newRAIDBlock;
+			added->diskCopy = backupDisk;
+			added->blockIDCopy = backupRAIDBlock;
+
+			result = addWriteRanges(&plan, tag, bnum + written, newDisk, newRAIDBlock, backupDisk,
+				backupRAIDBlock, blks - written, &vec[i].buf[written * TAGLINE_BLOCK_SIZE]);
+		}
+	}
+
+	// Writes what has been planned, even if a later range was invalid
+	if (runWritePlan(&plan) == -1) {
+		result = -1;
+	}
+
+	// Grows the tags over the blocks the batch has mapped, even if part of it
+	// failed, now that their extents are journaled
+	for (k = 0; k < count && k <= i; k++) {
+		if (growTag(vec[k].tag, vec[k].bnum + vec[k].blks) == -1) {
+			result = -1;
+		}
+	}
+
+	// Records the checksums of the planned ranges in order, so a block written
+	// twice keeps the checksum of its last write, or forgets them on failure
+	for (k = 0; !(TAGLINE_DEDUP || TAGLINE_COMPRESS) && k < count && k <= i; k++) {
+		setChecksums(vec[k].tag, vec[k].bnum, vec[k].blks, (result == 0) ? vec[k].buf : NULL);
+	}
+
+	free(plan.ranges);
+	free(plan.added);
+	free(plan.scratch);
+
+	if (result == 0) {
+		logMessage(LOG_INFO_LEVEL, "TAGLINE : wrote %d ranges as a batch.", count);
+	}
+	return (result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : addVectorRange
+// Description  : Adds a range of blocks to the plan of a vectored request
+//
+// Inputs       : plan - the plan
+//                disk, blockID - the start of the range on RAID
+//                blocks - the number of blocks
+//                buf - the blocks of the range in the caller's buffer
+//                cached - whether the range is cached once transferred
+//                cacheTag, cacheBlock - the first block of the range in its tag
+// Outputs      : 0 if successful, -1 if failure
+
+int addVectorRange (vectorplan *plan, RAIDDiskID disk, RAIDBlockID blockID, int blocks,
+	char *buf, int cached, TagLineNumber cacheTag, TagLineBlockNumber cacheBlock) {
+
+	// Declares local variables
+	vectorrange *range;
+
+	// Grows the list of ranges as needed
+	if (plan->count == plan->size) {
+		range = (vectorrange *) realloc(plan->ranges, (plan->size + 32) * sizeof(vectorrange));
+		if (range == NULL) {
+			logMessage(LOG_ERROR_LEVEL, "Memory allocation failed.");
+			return (-1);
+		}
+		plan->ranges = range;
+		plan->size += 32;
+	}
+
+	range = &plan->ranges[plan->count];
+	range->disk = disk;
+	range->blockID = blockID;
+	range->blocks = blocks;
+	range->buf = buf;
+	range->cached = cached;
+	range->cacheTag = cacheTag;
+	range->cacheBlock = cacheBlock;
+	range->order = plan->count++;
+
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : addWriteRanges
+// Description  : Plans the write of a run of blocks to its primary and backup
+//                copies. In write-back mode the blocks are only held dirty in
+//                the cache, as storeBlocks does; a copy waiting to be rebuilt is
+//                left stale. The blocks are cached once, through the first copy
+//                written.
+//
+// Inputs       : plan - the plan
+//                tag, bnum - the first block of the run in its tag
+//                disk, blockID - the start of the primary copy
+//                diskCopy, blockIDCopy - the start of the backup copy
+//                blocks - the number of blocks
+//                buf - the blocks to write
+// Outputs      : 0 if successful, -1 if failure
+
+int addWriteRanges (vectorplan *plan, TagLineNumber tag, TagLineBlockNumber bnum, RAIDDiskID disk,
+	RAIDBlockID blockID, RAIDDiskID diskCopy, RAIDBlockID blockIDCopy, int blocks, char *buf) {
+
+	// Declares local variables
+	int primary;
+
+	if (raid_cache_write_back()) {
+		return (storeBlocks(tag, bnum, disk, blockID, diskCopy, blockIDCopy, blocks, buf));
+	}
+
+	primary = !isStale(disk, blockID, blocks);
+	if (primary && addVectorRange(plan, disk, blockID, blocks, buf, 1, tag, bnum) == -1) {
+		return (-1);
+	}
+	if (!isStale(diskCopy, blockIDCopy, blocks)) {
+		if (addVectorRange(plan, diskCopy, blockIDCopy, blocks, buf, !primary, tag, bnum) == -1) {
+			return (-1);
+		}
+	}
+	else if (!primary) {
+		// Neither copy is written, so the blocks are no longer cached either
+		invalidate_raid_cache(tag, bnum, blocks);
+	}
+
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : runVectorPlan
+// Description  : Sorts the ranges of a plan by disk and block and transfers
+//                them, one RAID request for every run of ranges that are
+//                adjacent on a disk (up to RAID_MAX_XFER blocks). Merged ranges
+//                are gathered into or scattered from the plan's scratch buffer.
+//
+// Inputs       : plan - the plan
+//                requestType - RAID_READ or RAID_WRITE
+// Outputs      : 0 if successful, -1 if failure
+
+int runVectorPlan (vectorplan *plan, uint64_t requestType) {
+
+	// Declares local variables
+	vectorrange *ranges = plan->ranges;
+	RAIDOpCode response;
+	int arr[RAID_OPCODE_MAXVAL] = {0};
+	int i, j, k, blocks, requests = 0;
+	char *buf, *place;
+
+	qsort(ranges, plan->count, sizeof(vectorrange), compareVectorRanges);
+
+	for (i = 0; i < plan->count; i = j) {
+		// Gathers the ranges that continue the run on the same disk
+		blocks = ranges[i].blocks;
+		for (j = i + 1; j < plan->count && ranges[j].disk == ranges[i].disk
+				&& ranges[j].blockID == ranges[i].blockID + blocks
+				&& blocks + ranges[j].blocks <= RAID_MAX_XFER; j++) {
+			blocks += ranges[j].blocks;
+		}
+
+		// A lone range is transferred in place
+		buf = ranges[i].buf;
+		if (j > i + 1) {
+			if (plan->scratch == NULL &&
+					(plan->scratch = malloc(RAID_MAX_XFER * RAID_BLOCK_SIZE)) == NULL) {
+				logMessage(LOG_ERROR_LEVEL, "Memory allocation failed.");
+				return (-1);
+			}
+			buf = plan->scratch;
+			for (k = i, place = buf; k < j && requestType == RAID_WRITE; k++) {
+				memcpy(place, ranges[k].buf, ranges[k].blocks * RAID_BLOCK_SIZE);
+				place += ranges[k].blocks * RAID_BLOCK_SIZE;
+			}
+		}
+
+		response = create_raid_request(requestType, blocks, ranges[i].disk, 0, 0,
+			ranges[i].blockID, buf);
+		extract_raid_response(response, arr, RAID_OPCODE_MAXVAL);
+		if (arr[RAID_OPCODE_STATUS] == 1) {
+			logMessage(LOG_ERROR_LEVEL, "A RAID command failed.");
+			return (-1);
+		}
+		requests++;
+
+		for (k = i, place = buf; k < j && j > i + 1 && requestType == RAID_READ; k++) {
+			memcpy(ranges[k].buf, place, ranges[k].blocks * RAID_BLOCK_SIZE);
+			place += ranges[k].blocks * RAID_BLOCK_SIZE;
+		}
+	}
+
+	logMessage(LOG_INFO_LEVEL, "TAGLINE : transferred %d ranges in %d RAID requests.",
+			plan->count, requests);
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : runWritePlan
+// Description  : Writes the planned ranges of a vectored write, caches them,
+//                then maps and journals the new extents. The plan is emptied.
+//                If the write fails the blocks of the new extents are freed;
+//                once it has succeeded every new extent is mapped, even if
+//                journaling one of them fails.
+//
+// Inputs       : plan - the plan
+// Outputs      : 0 if successful, -1 if failure
+
+int runWritePlan (vectorplan *plan) {
+
+	// Declares local variables
+	vectorrange *range;
+	tableinfo *added;
+	int i, j, written, result;
+
+	result = written = runVectorPlan(plan, RAID_WRITE);
+
+	// Updates every block written in the cache
+	for (i = 0; i < plan->count && result == 0; i++) {
+		range = &plan->ranges[i];
+		if (!range->cached) {
+			continue;
+		}
+		for (j = 0; j < range->blocks; j++) {
+			if (get_raid_cache(range->cacheTag, range->cacheBlock + j) == NULL) misses++; else hits++;
+		}
+		put_raid_cache_blocks(range->cacheTag, range->cacheBlock, range->blocks, range->buf);
+	}
+
+	// Maps the new extents and records them in the journal
+	pthread_mutex_lock(&mapLock);
+	for (i = 0; i < plan->addedCount; i++) {
+		added = &plan->added[i];
+		if (written == -1) {
+			markBlocks(added->disk, added->blockID, added->contiguous, FALSE);
+			markBlocks(added->diskCopy, added->blockIDCopy, added->contiguous, FALSE);
+		}
+		else if (mapExtent(added->tagline, added->taglineBlock, added->contiguous, added->disk,
+				added->blockID, added->diskCopy, added->blockIDCopy) == NULL) {
+			markBlocks(added->disk, added->blockID, added->contiguous, FALSE);
+			markBlocks(added->diskCopy, added->blockIDCopy, added->contiguous, FALSE);
+			logMessage(LOG_ERROR_LEVEL, "Memory allocation failed.");
+			result = -1;
+		}
+		else {
+			referenceBlocks(added->disk, added->blockID, added->contiguous);
+			if (journalAppend(JOURNAL_EXTENT, added->tagline, added->taglineBlock, added->contiguous,
+					added->disk, added->blockID, added->diskCopy, added->blockIDCopy) == -1) {
+				result = -1;
+			}
+		}
+	}
+	pthread_mutex_unlock(&mapLock);
+
+	plan->count = 0;
+	plan->addedCount = 0;
+	return (result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : compareVectorRanges
+// Description  : Orders ranges by disk, then block number, then the order they
+//                were planned in (qsort)
+//
+// Inputs       : a, b - the ranges to compare
+// Outputs      : negative, zero or positive as a sorts before, with or after b
+
+int compareVectorRanges (const void *a, const void *b) {
+
+	const vectorrange *x = (const vectorrange *) a, *y = (const vectorrange *) b;
+
+	if (x->disk != y->disk) {
+		return (x->disk < y->disk) ? -1 : 1;
+	}
+	if (x->blockID != y->blockID) {
+		return (x->blockID < y->blockID) ? -1 : 1;
+	}
+	return (x->order - y->order);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dedupWrite
+// Description  : Writes a number of blocks of a tag, storing each distinct
+//                block once. A block whose contents are already stored is
+//                mapped to that copy, a block rewritten with the contents it
+//                has is skipped, a block that is the only user of its copy is
+//                overwritten in place, and the rest (new blocks and blocks
+//                whose copy is shared) are stored in a new extent. Consecutive
+//                blocks overwritten in one extent or stored anew go out as one
+//                run. Called with the tag's lock held and the rebuild lock held
+//                for reading.
+//
+// Inputs       : tag - the number of the tagline to write to
+//                bnum - the starting block to write
+//                blks - the number of blocks to write
+//                buf - the blocks to write
+// Outputs      : 0 if successful, -1 if failure
+
+int dedupWrite (TagLineNumber tag, TagLineBlockNumber bnum, uint8_t blks, char *buf) {
+
+	// Declares local variables
+	char signatures[RAID_MAX_XFER][DEDUP_SIGNATURE_SIZE];
+	tableinfo *temp, *target = NULL, *runExtent = NULL;
+	dedupentry *match, shared;
+	dedupblock *state;
+	uint32_t size;
+	int i, k, entry, offset = 0, runnable, runStart = 0, runBlocks = 0, result, sharing;
+
+	// Fingerprints every block
+	pthread_mutex_lock(&signatureLock);
+	for (i = 0; i < blks; i++) {
+		size = DEDUP_SIGNATURE_SIZE;
+		if (generate_md5_signature(&buf[i * TAGLINE_BLOCK_SIZE], TAGLINE_BLOCK_SIZE,
+				signatures[i], &size) != 0 || size != DEDUP_SIGNATURE_SIZE) {
+			pthread_mutex_unlock(&signatureLock);
+			logMessage(LOG_ERROR_LEVEL, "A block signature could not be computed.");
+			return (-1);
+		}
+	}
+	pthread_mutex_unlock(&signatureLock);
+
+	for (i = 0; i < blks; i++) {
+		// Stores the run first if the block repeats one of its blocks, so the
+		// block is mapped to it
+		for (k = runStart; k < runStart + runBlocks; k++) {
+			if (memcmp(signatures[k], signatures[i], DEDUP_SIGNATURE_SIZE) == 0) {
+				break;
+			}
+		}
+		if (k < runStart + runBlocks) {
+			if (storeDedupRun(tag, bnum + runStart, runBlocks, runExtent,
+					&buf[runStart * TAGLINE_BLOCK_SIZE], &signatures[runStart]) == -1) {
+				return (-1);
+			}
+			runBlocks = 0;
+		}
+
+		// Looks up the block's current copy and a stored copy of its contents
+		pthread_mutex_lock(&mapLock);
+		temp = getTagEntry(tag, bnum + i);
+		state = NULL;
+		if (temp != NULL) {
+			offset = bnum + i - temp->taglineBlock;
+			state = &dedupBlocks[(temp->disk * DISK_BLOCKS) + temp->blockID + offset];
+		}
+		entry = findDuplicate(signatures[i]);
+
+		// Only blocks that are written join a run: in place in the block's own
+		// extent, or anew
+		runnable = (entry == -1);
+		target = (state != NULL && state->refs == 1 && !temp->packed) ? temp : NULL;
+
+		// Stores the run first if the block cannot join it, then looks again
+		if (runBlocks > 0 && (!runnable || target != runExtent)) {
+			pthread_mutex_unlock(&mapLock);
+			if (storeDedupRun(tag, bnum + runStart, runBlocks, runExtent,
+					&buf[runStart * TAGLINE_BLOCK_SIZE], &signatures[runStart]) == -1) {
+				return (-1);
+			}
+			runBlocks = 0;
+			i--;
+			continue;
+		}
+
+		result = 0;
+		sharing = 0;
+		if (entry != -1 && state != NULL && state->entry == entry + 1) {
+			// Skips a block rewritten with the contents it already has
+			dedupSkipped++;
+		}
+		else if (entry != -1) {
+			// Maps the block to the stored copy of its contents
+			match = &dedupEntries[entry];
+			if (temp != NULL) {
+				result = unmapBlock(tag, bnum + i);
+				if (result == 0) {
+					result = journalAppend(JOURNAL_UNMAP, tag, bnum + i, 0, 0, 0, 0, 0);
+				}
+			}
+			if (result == 0 && mapExtent(tag, bnum + i, 1, match->disk, match->blockID,
+					match->diskCopy, match->blockIDCopy) == NULL) {
+				logMessage(LOG_ERROR_LEVEL, "Memory allocation failed.");
+				result = -1;
+			}
+			if (result == 0) {
+				referenceBlocks(match->disk, match->blockID, 1);
+				result = journalAppend(JOURNAL_EXTENT, tag, bnum + i, 1, match->disk,
+					match->blockID, match->diskCopy, match->blockIDCopy);
+				dedupShared++;
+				shared = *match;
+				sharing = 1;
+			}
+		}
+		else if (target != NULL) {
+			// Keeps other blocks from being mapped to the copy while it is overwritten
+			unregisterBlock(temp->disk, temp->blockID + offset);
+		}
+		else if (temp != NULL) {
+			// Takes the block off its shared copy, to be stored anew
+			result = unmapBlock(tag, bnum + i);
+			if (result == 0) {
+				result = journalAppend(JOURNAL_UNMAP, tag, bnum + i, 0, 0, 0, 0, 0);
+			}
+		}
+		pthread_mutex_unlock(&mapLock);
+
+		if (result == -1) {
+			return (-1);
+		}
+
+		// Caches a block mapped to a stored copy. In write-back mode it is held
+		// dirty, as the copy may not have been written back yet. Dirtiness is
+		// kept per tag block, so every block sharing the copy takes its own
+		// slot and writes the copy back once more when it is evicted.
+		if (sharing && raid_cache_write_back()) {
+			if (put_raid_cache_dirty(tag, bnum + i, shared.disk, shared.blockID, shared.diskCopy,
+					shared.blockIDCopy, 1, &buf[i * TAGLINE_BLOCK_SIZE]) == -1) {
+				logMessage(LOG_ERROR_LEVEL, "Caching a dirty block failed.");
+				return (-1);
+			}
+		}
+		else if (sharing) {
+			put_raid_cache(tag, bnum + i, &buf[i * TAGLINE_BLOCK_SIZE]);
+		}
+
+		// Adds the block to the run
+		if (runnable) {
+			if (runBlocks == 0) {
+				runStart = i;
+				runExtent = target;
+			}
+			runBlocks++;
+		}
+	}
+
+	if (runBlocks > 0) {
+		return (storeDedupRun(tag, bnum + runStart, runBlocks, runExtent,
+			&buf[runStart * TAGLINE_BLOCK_SIZE], &signatures[runStart]));
+	}
+
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : storeDedupRun
+// Description  : Stores a run of blocks of a deduplicated write, either over
+//                their copies in an extent or in a new extent, and registers
+//                them in the dedup index
+//
+// Inputs       : tag - the number of the tagline
+//                bnum - the first block of the run
+//                blks - the number of blocks
+//                extent - the extent to overwrite, or NULL to store the blocks anew
+//                buf - the blocks
+//                signatures - the signatures of the blocks
+// Outputs      : 0 if successful, -1 if failure
+
+int storeDedupRun (TagLineNumber tag, TagLineBlockNumber bnum, int blks, tableinfo *extent,
+	char *buf, char signatures[][DEDUP_SIGNATURE_SIZE]) {
+
+	// Declares local variables
+	int offset = 0, i;
+
+	if (extent != NULL) {
+		offset = bnum - extent->taglineBlock;
+		if (storeBlocks(tag, bnum, extent->disk, extent->blockID + offset, extent->diskCopy,
+				extent->blockIDCopy + offset, blks, buf) == -1) {
+			return (-1);
+		}
+	}
+	else {
+		if (insertEntry(tag, bnum, blks, buf) == -1) {
+			logMessage(LOG_ERROR_LEVEL, "Insert has failed. Bye bye!");
+			return (-1);
+		}
+		extent = getTagEntry(tag, bnum);
+	}
+
+	// Later blocks with the same contents are mapped to these copies
+	pthread_mutex_lock(&mapLock);
+	for (i = 0; i < blks; i++) {
+		registerBlock(signatures[i], extent->disk, extent->blockID + offset + i,
+			extent->diskCopy, extent->blockIDCopy + offset + i);
+	}
+	pthread_mutex_unlock(&mapLock);
+
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : findDuplicate
+// Description  : Looks a signature up in the dedup index. A block that has as
+//                many references as its count can hold is not matched.
+//
+// Inputs       : signature - the signature of the contents
+// Outputs      : the index of the entry of a block with those contents, or -1
+
+int findDuplicate (const char *signature) {
+
+	// Declares local variables
+	uint32_t hash;
+	int entry;
+
+	memcpy(&hash, signature, sizeof(hash));
+	for (entry = dedupBuckets[hash % DEDUP_BUCKETS]; entry != -1; entry = dedupEntries[entry].next) {
+		if (memcmp(dedupEntries[entry].signature, signature, DEDUP_SIGNATURE_SIZE) == 0 &&
+				dedupBlocks[(dedupEntries[entry].disk * DISK_BLOCKS) +
+				dedupEntries[entry].blockID].refs < DEDUP_MAX_REFS) {
+			return (entry);
+		}
+	}
+
+	return (-1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : registerBlock
+// Description  : Adds a stored block to the dedup index, unless it is already
+//                registered or another block with the same contents is. If
+//                the index cannot grow the block is simply not registered.
+//
+// Inputs       : signature - the signature of the block's contents
+//                disk, blockID - the primary copy of the block
+//                diskCopy, blockIDCopy - the backup copy of the block
+// Outputs      : none
+
+void registerBlock (const char *signature, RAIDDiskID disk, RAIDBlockID blockID,
+	RAIDDiskID diskCopy, RAIDBlockID blockIDCopy) {
+
+	// Declares local variables
+	dedupblock *state = &dedupBlocks[(disk * DISK_BLOCKS) + blockID];
+	dedupentry *list;
+	uint32_t hash;
+	int entry;
+
+	if (state->entry != 0 || findDuplicate(signature) != -1) {
+		return;
+	}
+
+	// Takes an entry from the free list, or doubles the pool when it is full
+	if (dedupFree != -1) {
+		entry = dedupFree;
+		dedupFree = dedupEntries[entry].next;
+	}
+	else {
+		if (dedupCount == dedupSize) {
+			list = (dedupentry *) realloc(dedupEntries,
+				(dedupSize ? dedupSize * 2 : EXTENT_CHUNK_SIZE) * sizeof(dedupentry));
+			if (!list) {
+				return;
+			}
+			dedupEntries = list;
+			dedupSize = dedupSize ? dedupSize * 2 : EXTENT_CHUNK_SIZE;
+		}
+		entry = dedupCount++;
+	}
+
+	memcpy(dedupEntries[entry].signature, signature, DEDUP_SIGNATURE_SIZE);
+	dedupEntries[entry].disk = disk;
+	dedupEntries[entry].blockID = blockID;
+	dedupEntries[entry].diskCopy = diskCopy;
+	dedupEntries[entry].blockIDCopy = blockIDCopy;
+
+	memcpy(&hash, signature, sizeof(hash));
+	dedupEntries[entry].next = dedupBuckets[hash % DEDUP_BUCKETS];
+	dedupBuckets[hash % DEDUP_BUCKETS] = entry;
+	state->entry = entry + 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unregisterBlock
+// Description  : Removes a block from the dedup index, if it is registered
+//
+// Inputs       : disk, blockID - the primary copy of the block
+// Outputs      : none
+
+void unregisterBlock (RAIDDiskID disk, RAIDBlockID blockID) {
+
+	// Declares local variables
+	dedupblock *state = &dedupBlocks[(disk * DISK_BLOCKS) + blockID];
+	uint32_t hash;
+	int entry, *link;
+
+	if (state->entry == 0) {
+		return;
+	}
+	entry = state->entry - 1;
+	state->entry = 0;
+
+	// Unlinks the entry from its bucket and puts it on the free list
+	memcpy(&hash, dedupEntries[entry].signature, sizeof(hash));
+	for (link = &dedupBuckets[hash % DEDUP_BUCKETS]; *link != entry; link = &dedupEntries[*link].next);
+	*link = dedupEntries[entry].next;
+
+	dedupEntries[entry].next = dedupFree;
+	dedupFree = entry;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : referenceBlocks
+// Description  : Counts a range of blocks as mapped by one more tag block
+//                each, when blocks are deduplicated or packed
+//
+// Inputs       : disk, blockID - the start of the primary copy
+//                blks - the number of blocks
+// Outputs      : none
+
+void referenceBlocks (RAIDDiskID disk, RAIDBlockID blockID, int blks) {
+
+	// Declares local variables
+	int i;
+
+	if (!TAGLINE_DEDUP && !TAGLINE_COMPRESS) {
+		return;
+	}
+
+	for (i = 0; i < blks; i++) {
+		dedupBlocks[(disk * DISK_BLOCKS) + blockID + i].refs++;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : releaseBlocks
+// Description  : Drops one reference to each of a range of blocks that a tag
+//                no longer maps. A block left without references is dropped
+//                from the dedup index and given back to the occupancy
+//                bitmaps; while a rebuild is in progress that waits
+//                until it is done, since the rebuild may still copy over it.
+//                Without deduplication or packing every block has one reference.
+//
+// Inputs       : disk, blockID - the start of the primary copy
+//                diskCopy, blockIDCopy - the start of the backup copy
+//                blks - the number of blocks
+// Outputs      : none
+
+void releaseBlocks (RAIDDiskID disk, RAIDBlockID blockID, RAIDDiskID diskCopy,
+	RAIDBlockID blockIDCopy, int blks) {
+
+	// Declares local variables
+	dedupblock *state;
+	RAIDBlockID blk, blkCopy;
+	int i;
+
+	for (i = 0; i < blks; i++) {
+		blk = blockID + i;
+		blkCopy = blockIDCopy + i;
+
+		// Keeps a block that other tag blocks still map
+		if (TAGLINE_DEDUP || TAGLINE_COMPRESS) {
+			state = &dedupBlocks[(disk * DISK_BLOCKS) + blk];
+			if (state->refs > 1) {
+				state->refs--;
+				continue;
+			}
+			state->refs = 0;
+			unregisterBlock(disk, blk);
+		}
+
+		if (rebuildTarget != -1) {
+			deferredBitmap[disk][blk / BITMAP_WORD_BITS] |= ((uint64_t) 1 << (blk % BITMAP_WORD_BITS));
+			deferredBitmap[diskCopy][blkCopy / BITMAP_WORD_BITS] |= ((uint64_t) 1 << (blkCopy % BITMAP_WORD_BITS));
+		}
+		else {
+			markBlocks(disk, blk, 1, FALSE);
+			markBlocks(diskCopy, blkCopy, 1, FALSE);
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : releaseDeferredBlocks
+// Description  : Gives the blocks freed during a rebuild back to the occupancy
+//                bitmaps once no rebuild is in progress. Called with the
+//                rebuild lock held for writing, which keeps the allocator idle.
+//
+// Inputs       : none
+// Outputs      : none
+
+void releaseDeferredBlocks (void) {
+
+	// Declares local variables
+	int i, w;
+
+	for (i = 0; i < NUM_DISKS; i++) {
+		for (w = 0; w < BITMAP_WORDS; w++) {
+			diskBitmap[i][w] &= ~deferredBitmap[i][w];
+			deferredBitmap[i][w] = 0;
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unmapBlock
+// Description  : Takes one block of a tag out of its extent, releases its copy
+//                and drops it from the cache. The extent is freed, shortened, or
+//                split in two around the block. Called with the tag's lock and
+//                the map lock held.
+//
+// Inputs       : tag - the tag number
+//                bnum - the block to unmap
+// Outputs      : 0 for success, or -1 for failure
+
+int unmapBlock (TagLineNumber tag, TagLineBlockNumber bnum) {
+
+	// Declares local variables
+	tableinfo *temp;
+	int offset, rest;
+
+	if ((temp = getTagEntry(tag, bnum)) == NULL) {
+		return (0);
+	}
+	offset = bnum - temp->taglineBlock;
+
+	releaseBlocks(temp->disk, temp->blockID + offset, temp->diskCopy, temp->blockIDCopy + offset, 1);
+	tagDirectory[(tag * MAX_TAGLINE_BLOCK_NUMBER) + bnum] = NULL;
+	invalidate_raid_cache(tag, bnum, 1);
+
+	if (temp->contiguous == 1) {
+		unindexExtent(temp);
+		freeExtent(temp);
+	}
+	else if (offset == 0) {
+		temp->taglineBlock++;
+		temp->blockID++;
+		temp->blockIDCopy++;
+		temp->contiguous--;
+	}
+	else if (offset == temp->contiguous - 1) {
+		temp->contiguous--;
+	}
+	else {
+		// Maps the blocks after the unmapped one to an extent of their own
+		rest = temp->contiguous - offset - 1;
+		temp->contiguous = offset;
+		if (mapExtent(tag, bnum + 1, rest, temp->disk, temp->blockID + offset + 1,
+				temp->diskCopy, temp->blockIDCopy + offset + 1) == NULL) {
+			logMessage(LOG_ERROR_LEVEL, "Memory allocation failed.");
+			return (-1);
+		}
+	}
+
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : compressWrite
+// Description  : Writes a number of blocks of a tag, packing the blocks that
+//                compress to at most COMPRESS_MAX_SIZE bytes several to a
+//                block and storing the rest whole. Each run of consecutive
+//                blocks of either kind is written together. Called with the
+//                tag's lock held and the rebuild lock held for reading.
+//
+// Inputs       : tag - the number of the tagline to write to
+//                bnum - the starting block to write
+//                blks - the number of blocks to write
+//                buf - the blocks to write
+// Outputs      : 0 if successful, -1 if failure
+
+int compressWrite (TagLineNumber tag, TagLineBlockNumber bnum, uint8_t blks, char *buf) {
+
+	// Declares local variables
+	char *encoded;
+	int sizes[RAID_MAX_XFER];
+	int i, j, k, result = 0;
+
+	if ((encoded = malloc(blks * COMPRESS_MAX_SIZE)) == NULL) {
+		logMessage(LOG_ERROR_LEVEL, "Memory allocation failed.");
+		return (-1);
+	}
+
+	// Compresses every block, noting a size of 0 for those that do not compress
+	for (i = 0; i < blks; i++) {
+		sizes[i] = compressBlock(&buf[i * TAGLINE_BLOCK_SIZE], &encoded[i * COMPRESS_MAX_SIZE]);
+	}
+
+	for (i = 0; i < blks && result == 0; i = j) {
+		for (j = i + 1; j < blks && (sizes[j] > 0) == (sizes[i] > 0); j++);
+
+		if (sizes[i] > 0) {
+			// Counts the blocks already cached, as storeBlocks does
+			for (k = i; k < j; k++) {
+				if (get_raid_cache(tag, bnum + k) == NULL) misses++; else hits++;
+			}
+			result = storePackedRun(tag, bnum + i, j - i, &encoded[i * COMPRESS_MAX_SIZE], &sizes[i]);
+			if (result == 0) {
+				put_raid_cache_blocks(tag, bnum + i, j - i, &buf[i * TAGLINE_BLOCK_SIZE]);
+			}
+		}
+		else {
+			result = writeWholeBlocks(tag, bnum + i, j - i, &buf[i * TAGLINE_BLOCK_SIZE]);
+		}
+	}
+
+	free(encoded);
+	return (result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : storePackedRun
+// Description  : Packs a run of compressed blocks of a tag back to back into
+//                as few new blocks as they fit in (a compressed block never
+//                straddles two blocks), stores them, and remaps each tag block
+//                to its offset in them. Packed blocks are never overwritten in
+//                place: a block is freed once none of the tag blocks packed in
+//                it are still mapped to it, so packing never takes more blocks
+//                than storing the tag blocks whole.
+//
+// Inputs       : tag - the number of the tagline
+//                bnum - the first block of the run
+//                blks - the number of blocks
+//                encoded - the compressed blocks, COMPRESS_MAX_SIZE bytes apart
+//                sizes - the size of each compressed block
+// Outputs      : 0 if successful, -1 if failure
+
+int storePackedRun (TagLineNumber tag, TagLineBlockNumber bnum, int blks, char *encoded,
+	int sizes[]) {
+
+	// Declares local variables
+	RAIDDiskID disk, diskCopy;
+	RAIDBlockID blockID, blockIDCopy;
+	tableinfo *temp;
+	char *packed;
+	int offsets[RAID_MAX_XFER];
+	int i, used = 0, packedCount, result = 0;
+
+	// Lays the blocks out, moving on to the next block when one does not fit
+	for (i = 0; i < blks; i++) {
+		if ((used % TAGLINE_BLOCK_SIZE) + sizes[i] > TAGLINE_BLOCK_SIZE) {
+			used += TAGLINE_BLOCK_SIZE - (used % TAGLINE_BLOCK_SIZE);
+		}
+		offsets[i] = used;
+		used += sizes[i];
+	}
+	packedCount = (used + TAGLINE_BLOCK_SIZE - 1) / TAGLINE_BLOCK_SIZE;
+
+	if ((packed = calloc(packedCount, TAGLINE_BLOCK_SIZE)) == NULL) {
+		logMessage(LOG_ERROR_LEVEL, "Memory allocation failed.");
+		return (-1);
+	}
+	for (i = 0; i < blks; i++) {
+		memcpy(&packed[offsets[i]], &encoded[i * COMPRESS_MAX_SIZE], sizes[i]);
+	}
+
+	// Writes the packed blocks through to a new range on both copies, even in
+	// write-back mode, as the cache only holds the tag blocks packed in them
+	if (allocateCopies(packedCount, &disk, &blockID, &diskCopy, &blockIDCopy) == -1) {
+		free(packed);
+		return (-1);
+	}
+	if (writeCopies(disk, blockID, diskCopy, blockIDCopy, packedCount, packed) == -1) {
+		pthread_mutex_lock(&mapLock);
+		markBlocks(disk, blockID, packedCount, FALSE);
+		markBlocks(diskCopy, blockIDCopy, packedCount, FALSE);
+		pthread_mutex_unlock(&mapLock);
+		free(packed);
+		return (-1);
+	}
+	free(packed);
+
+	// Maps every tag block to its place in the packed blocks, releasing its
+	// old copy, and records both in the journal
+	pthread_mutex_lock(&mapLock);
+	for (i = 0; i < blks && result == 0; i++) {
+		if (getTagEntry(tag, bnum + i) != NULL) {
+			result = unmapBlock(tag, bnum + i);
+			if (result == 0) {
+				result = journalAppend(JOURNAL_UNMAP, tag, bnum + i, 0, 0, 0, 0, 0);
+			}
+			if (result == -1) {
+				break;
+			}
+		}
+
+		if ((temp = mapExtent(tag, bnum + i, 1, disk, blockID + (offsets[i] / TAGLINE_BLOCK_SIZE),
+				diskCopy, blockIDCopy + (offsets[i] / TAGLINE_BLOCK_SIZE))) == NULL) {
+			logMessage(LOG_ERROR_LEVEL, "Memory allocation failed.");
+			result = -1;
+			break;
+		}
+		temp->packed = (offsets[i] % TAGLINE_BLOCK_SIZE) + 1;
+		referenceBlocks(temp->disk, temp->blockID, 1);
+		result = journalAppend(JOURNAL_PACKED, tag, bnum + i, temp->packed, temp->disk,
+			temp->blockID, temp->diskCopy, temp->blockIDCopy);
+	}
+	pthread_mutex_unlock(&mapLock);
+
+	packedBlocks += blks;
+	packBlocksUsed += packedCount;
+	return (result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : allocateCopies
+// Description  : Reserves a contiguous range of free blocks for the primary
+//                copy, starting from a random disk, and one for the backup
+//                copy on any other disk
+//
+// Inputs       : blks - the number of blocks to reserve
+//                disk, blockID - set to the start of the primary copy
+//                diskCopy, blockIDCopy - set to the start of the backup copy
+// Outputs      : 0 if successful, -1 if there is not enough free space
+
+int allocateCopies (uint8_t blks, RAIDDiskID *disk, RAIDBlockID *blockID, RAIDDiskID *diskCopy,
+	RAIDBlockID *blockIDCopy) {
+
+	pthread_mutex_lock(&mapLock);
+	if (allocateBlocks(rand() % NUM_DISKS, NUM_DISKS, blks, disk, blockID) == -1) {
+		pthread_mutex_unlock(&mapLock);
+		logMessage(LOG_ERROR_LEVEL, "No free RAID blocks for the primary copy.");
+		return (-1);
+	}
+
+	if (allocateBlocks((*disk + 1 + (rand() % (NUM_DISKS - 1))) % NUM_DISKS, *disk,
+			blks, diskCopy, blockIDCopy) == -1) {
+		markBlocks(*disk, *blockID, blks, FALSE);
+		pthread_mutex_unlock(&mapLock);
+		logMessage(LOG_ERROR_LEVEL, "No free RAID blocks for the backup copy.");
+		return (-1);
+	}
+	pthread_mutex_unlock(&mapLock);
+
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : compressBlock
+// Description  : Run-length encodes a block. The encoding is a sequence of
+//                control bytes: a control byte below 128 is followed by that
+//                many literal bytes plus one, and a control byte c of 128 or
+//                more by a byte repeated c - 128 + COMPRESS_MIN_RUN times.
+//
+// Inputs       : block - the block to compress
+//                encoded - receives up to COMPRESS_MAX_SIZE bytes of encoding
+// Outputs      : the size of the encoding, or 0 if it would not fit
+
+int compressBlock (const char *block, char *encoded) {
+
+	// Declares local variables
+	int in = 0, size = 0, run, length;
+
+	while (in < TAGLINE_BLOCK_SIZE) {
+		for (run = 1; in + run < TAGLINE_BLOCK_SIZE && run < COMPRESS_MAX_RUN
+				&& block[in + run] == block[in]; run++);
+
+		if (run >= COMPRESS_MIN_RUN) {
+			// Encodes a run of a repeated byte
+			if (size + 2 > COMPRESS_MAX_SIZE) {
+				return (0);
+			}
+			encoded[size++] = (char) (128 + run - COMPRESS_MIN_RUN);
+			encoded[size++] = block[in];
+			in += run;
+		}
+		else {
+			// Copies the bytes up to the next run literally
+			for (length = 1; in + length < TAGLINE_BLOCK_SIZE && length < COMPRESS_MAX_LITERAL; length++) {
+				if (in + length + 2 < TAGLINE_BLOCK_SIZE && block[in + length] == block[in + length + 1]
+						&& block[in + length] == block[in + length + 2]) {
+					break;
+				}
+			}
+			if (size + 1 + length > COMPRESS_MAX_SIZE) {
+				return (0);
+			}
+			encoded[size++] = (char) (length - 1);
+			memcpy(&encoded[size], &block[in], length);
+			size += length;
+			in += length;
+		}
+	}
+
+	return (size);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : decompressBlock
+// Description  : Decodes a block compressed by compressBlock, filling runs
+//                with memset and copying literals with memcpy
+//
+// Inputs       : packed - the block the compressed block is packed in
+//                offset - the offset of the compressed block in it
+//                block - receives the decompressed block
+// Outputs      : 0 if successful, -1 if the encoding is damaged
+
+int decompressBlock (const char *packed, int offset, char *block) {
+
+	// Declares local variables
+	int in = offset, out = 0, control, length;
+
+	while (out < TAGLINE_BLOCK_SIZE) {
+		if (in >= TAGLINE_BLOCK_SIZE) {
+			return (-1);
+		}
+		control = (uint8_t) packed[in++];
+
+		if (control >= 128) {
+			length = control - 128 + COMPRESS_MIN_RUN;
+			if (in >= TAGLINE_BLOCK_SIZE || out + length > TAGLINE_BLOCK_SIZE) {
+				return (-1);
+			}
+			memset(&block[out], packed[in++], length);
+		}
+		else {
+			length = control + 1;
+			if (in + length > TAGLINE_BLOCK_SIZE || out + length > TAGLINE_BLOCK_SIZE) {
+				return (-1);
+			}
+			memcpy(&block[out], &packed[in], length);
+			in += length;
+		}
+		out += length;
+	}
+
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : startScrubber
+// Description  : Starts the scrubber thread from the first tag, if scrubbing
+//                is on. The driver runs without it if it cannot be started.
+//
+// Inputs       : none
+// Outputs      : none
+
+void startScrubber (void) {
+
+	scrubRunning = FALSE;
+	scrubStopping = FALSE;
+	scrubTag = 0;
+	scrubBlock = 0;
+	scrubVerified = 0;
+	scrubRepaired = 0;
+
+	if (TAGLINE_SCRUB_RATE <= 0) {
+		return;
+	}
+
+	scrubBuf = malloc(RAID_MAX_XFER * RAID_BLOCK_SIZE);
+	scrubCopyBuf = malloc(RAID_MAX_XFER * RAID_BLOCK_SIZE);
+	if (scrubBuf == NULL || scrubCopyBuf == NULL ||
+			pthread_create(&scrubThread, NULL, scrubWorker, NULL) != 0) {
+		logMessage(LOG_WARNING_LEVEL, "The scrubber thread could not be started.");
+		free(scrubBuf);
+		free(scrubCopyBuf);
+		scrubBuf = NULL;
+		scrubCopyBuf = NULL;
+		return;
+	}
+	scrubRunning = TRUE;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stopScrubber
+// Description  : Stops the scrubber thread, if it runs, and waits for it
+//
+// Inputs       : none
+// Outputs      : none
+
+void stopScrubber (void) {
+
+	if (scrubRunning == FALSE) {
+		return;
+	}
+
+	pthread_mutex_lock(&scrubLock);
+	scrubStopping = TRUE;
+	pthread_cond_signal(&scrubWake);
+	pthread_mutex_unlock(&scrubLock);
+
+	pthread_join(scrubThread, NULL);
+	scrubRunning = FALSE;
+
+	free(scrubBuf);
+	free(scrubCopyBuf);
+	scrubBuf = NULL;
+	scrubCopyBuf = NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : scrubWorker
+// Description  : Verifies a slice of TAGLINE_SCRUB_RATE / 10 blocks every
+//                SCRUB_INTERVAL_USEC until the driver closes, so scrubbing
+//                never takes more than TAGLINE_SCRUB_RATE blocks a second
+//
+// Inputs       : unused - not used
+// Outputs      : NULL
+
+void *scrubWorker (void *unused) {
+
+	// Declares local variables
+	struct timespec wake;
+	int blocks = TAGLINE_SCRUB_RATE / (1000000 / SCRUB_INTERVAL_USEC);
+
+	if (blocks < 1) {
+		blocks = 1;
+	}
+
+	pthread_mutex_lock(&scrubLock);
+	while (scrubStopping == FALSE) {
+		// Waits for the next interval, or to be stopped
+		clock_gettime(CLOCK_REALTIME, &wake);
+		wake.tv_nsec += SCRUB_INTERVAL_USEC * 1000L;
+		if (wake.tv_nsec >= 1000000000L) {
+			wake.tv_sec++;
+			wake.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&scrubWake, &scrubLock, &wake);
+		if (scrubStopping == TRUE) {
+			break;
+		}
+
+		pthread_mutex_unlock(&scrubLock);
+		if (scrubSlice(blocks) == -1) {
+			logMessage(LOG_WARNING_LEVEL, "Scrubbing failed; it will be retried.");
+		}
+		pthread_mutex_lock(&scrubLock);
+	}
+	pthread_mutex_unlock(&scrubLock);
+
+	return (NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : scrubSlice
+// Description  : Verifies the mirrors of up to maxBlocks mapped blocks, going
+//                through the tags in order from the scrub cursor and starting
+//                over once past the last tag. Each tag is scrubbed under its
+//                lock and the rebuild lock held for reading, so no write or
+//                rebuild changes its blocks meanwhile. At most one pass over
+//                the tags is made, so a slice ends even if nothing is mapped.
+//
+// Inputs       : maxBlocks - the number of blocks to verify
+// Outputs      : 0 if successful, -1 if failure
 
-	free(maxBlockNumAllowed);
-	maxBlockNumAllowed = NULL;
+int scrubSlice (int maxBlocks) {
 
-	i = 0;
-	while (raidtable[i] != NULL) {
-		free(raidtable[i]);
-		raidtable[i] = NULL;
-		i++;
-	}
+	// Declares local variables
+	tableinfo *temp;
+	TagLineNumber tag;
+	int done = 0, visited = 0, offset, blks, finished, result = 0;
 
-	free(raidtable);
-	raidtable = NULL;
+	while (done < maxBlocks && visited <= (int) maxTaglines && result == 0) {
+		if (scrubTag >= maxTaglines) {
+			scrubTag = 0;
+			scrubBlock = 0;
+		}
+		tag = scrubTag;
 
-	// Prints out cache statistics
-	logMessage(LOG_OUTPUT_LEVEL, "--- Cache statistics ---");
-	logMessage(LOG_OUTPUT_LEVEL, "Cache gets: %d", hits + misses);
-	logMessage(LOG_OUTPUT_LEVEL, "Cache inserts: %d", misses);
-	logMessage(LOG_OUTPUT_LEVEL, "Cache hits: %d", hits);
-	logMessage(LOG_OUTPUT_LEVEL, "Cache misses: %d", misses);
-	logMessage(LOG_OUTPUT_LEVEL, "Cache hit rate: %5.2f%%", (double) hits / (hits + misses) * 100);
+		pthread_mutex_lock(&tagLocks[TAG_SHARD(tag)]);
+		pthread_rwlock_rdlock(&rebuildLock);
+		while (done < maxBlocks && scrubBlock < (TagLineBlockNumber) maxBlockNumAllowed[tag] && result == 0) {
+			// Skips blocks that are only in the write coalescing buffer so far
+			if ((temp = getTagEntry(tag, scrubBlock)) == NULL) {
+				scrubBlock++;
+				continue;
+			}
 
-	// Close the RAID cache
-	close_raid_cache();
+			// Verifies the extent from the cursor on
+			offset = scrubBlock - temp->taglineBlock;
+			blks = temp->contiguous - offset;
+			if (blks > maxBlocks - done) blks = maxBlocks - done;
 
-	// Closes the RAID disks
-	response = create_raid_request(RAID_CLOSE, 0, 0, 0, 0, 0, NULL);
-	
-	// Checks if the RAID command executed successfully
-	extract_raid_response(response, arr, RAID_OPCODE_MAXVAL);
-	if (arr[RAID_OPCODE_STATUS] == 1) {
-		logMessage(LOG_ERROR_LEVEL, "A RAID command failed. Bye bye!");
-		return (-1);
+			result = scrubExtent(temp, offset, blks);
+			scrubBlock += blks;
+			done += blks;
+		}
+		finished = (scrubBlock >= (TagLineBlockNumber) maxBlockNumAllowed[tag]);
+		pthread_rwlock_unlock(&rebuildLock);
+		pthread_mutex_unlock(&tagLocks[TAG_SHARD(tag)]);
+
+		// Moves on to the next tag once this one is done
+		if (finished) {
+			scrubTag++;
+			scrubBlock = 0;
+			visited++;
+		}
 	}
 
-	// Return successfully
-	logMessage(LOG_INFO_LEVEL, "TAGLINE storage device: closing completed.");
-	return(0);
+	return (result);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : raid_disk_signal
-// Description  : A disk has failed which needs to be recovered
+// Function     : scrubExtent
+// Description  : Verifies that the two copies of a run of blocks of an extent
+//                match, and rewrites each run of blocks of the backup copy
+//                that differs from the primary copy, or of the primary copy if
+//                only the backup copy passes its checksums. Both copies are
+//                read and compared here, as RAID_HASHBLOCK only logs its hash
+//                on the server. Copies that cannot be read, are waiting to be
+//                rebuilt or are held dirty in the cache are left for a later pass.
 //
-// Inputs       : none
-// Outputs      : 0 success, 1 is failure
+// Inputs       : entry - the extent
+//                offset - the first block to verify within the extent
+//                blks - the number of blocks to verify
+// Outputs      : 0 if successful, -1 if a repair failed
+
+int scrubExtent (tableinfo *entry, int offset, int blks) {
 
-int raid_disk_signal(void) {
-	
 	// Declares local variables
-	int i = 0, *cacheTemp; 
-	RAIDDiskID diskFailed;
-	RAIDOpCode response, responsetwo;
-	tableinfo *temp;
+	RAIDOpCode response;
+	RAIDDiskID repairDisk;
+	RAIDBlockID block = entry->blockID + offset, blockCopy = entry->blockIDCopy + offset, repairBlock;
 	int arr[RAID_OPCODE_MAXVAL] = {0};
 	int arrtwo[RAID_OPCODE_MAXVAL] = {0};
+	int i, j, fromCopy;
+	char *source;
 
-	// Determines which disk has failed
-	do {
-		response = create_raid_request(RAID_STATUS, 0, i, 0, 0, 0, NULL);
+	if (!usableCopy(entry->disk, block, blks) || !usableCopy(entry->diskCopy, blockCopy, blks)
+			|| dirty_raid_cache(entry->tagline, entry->taglineBlock + offset, blks)) {
+		return (0);
+	}
 
-		// Extracts the RAID opcode and stores it in an array
-		extract_raid_response(response, arr, RAID_OPCODE_MAXVAL);
+	// Reads both copies; a disk that has just failed is skipped
+	response = create_raid_request(RAID_READ, blks, entry->disk, 0, 0, block, scrubBuf);
+	extract_raid_response(response, arr, RAID_OPCODE_MAXVAL);
+	response = create_raid_request(RAID_READ, blks, entry->diskCopy, 0, 0, blockCopy, scrubCopyBuf);
+	extract_raid_response(response, arrtwo, RAID_OPCODE_MAXVAL);
+	if (arr[RAID_OPCODE_STATUS] == 1 || arrtwo[RAID_OPCODE_STATUS] == 1) {
+		refreshDiskStates();
+		return (0);
+	}
+	scrubVerified += blks;
 
-		// Checks if the RAID command executed successfully
-		if (arr[RAID_OPCODE_STATUS] == 1) {
-			logMessage(LOG_ERROR_LEVEL, "A RAID command failed. Bye bye!");
-			return (1);
+	// Rewrites each run of blocks that differ, and are to be repaired the
+	// same way, with the good copy
+	for (i = 0; i < blks; i = j) {
+		if (memcmp(&scrubBuf[i * RAID_BLOCK_SIZE], &scrubCopyBuf[i * RAID_BLOCK_SIZE], RAID_BLOCK_SIZE) == 0) {
+			j = i + 1;
+			continue;
 		}
+		fromCopy = repairFromCopy(entry, offset + i, &scrubBuf[i * RAID_BLOCK_SIZE],
+			&scrubCopyBuf[i * RAID_BLOCK_SIZE]);
+		for (j = i + 1; j < blks && memcmp(&scrubBuf[j * RAID_BLOCK_SIZE],
+				&scrubCopyBuf[j * RAID_BLOCK_SIZE], RAID_BLOCK_SIZE) != 0
+				&& repairFromCopy(entry, offset + j, &scrubBuf[j * RAID_BLOCK_SIZE],
+				&scrubCopyBuf[j * RAID_BLOCK_SIZE]) == fromCopy; j++);
 
-		i++;
-	} while (arr[RAID_OPCODE_BLOCKID] != RAID_DISK_FAILED);
+		if (fromCopy) {
+			repairDisk = entry->disk;
+			repairBlock = block;
+			source = scrubCopyBuf;
+		}
+		else {
+			repairDisk = entry->diskCopy;
+			repairBlock = blockCopy;
+			source = scrubBuf;
+		}
 
-	// Sets the number of the failed disk
-	diskFailed = i - 1;
+		response = create_raid_request(RAID_WRITE, j - i, repairDisk, 0, 0, repairBlock + i,
+			&source[i * RAID_BLOCK_SIZE]);
+		extract_raid_response(response, arr, RAID_OPCODE_MAXVAL);
+		if (arr[RAID_OPCODE_STATUS] == 1) {
+			logMessage(LOG_ERROR_LEVEL, "A RAID command failed.");
+			return (-1);
+		}
 
-	// Formats the failed disk
-	response = create_raid_request(RAID_FORMAT, 0, diskFailed, 0, 0, 0, NULL);
+		// Drops the blocks from the cache, which a read may have filled from
+		// the copy just overwritten: reads pick either copy, and a block whose
+		// checksum is off or not known yet is cached unchecked. Repairs are
+		// rare, so dropping a good block as well only costs one reread.
+		invalidate_raid_cache(entry->tagline, entry->taglineBlock + offset + i, j - i);
 
-	// Checks if the RAID command executed successfully
-	extract_raid_response(response, arr, RAID_OPCODE_MAXVAL);
-	if (arr[RAID_OPCODE_STATUS] == 1) {
-		logMessage(LOG_ERROR_LEVEL, "A RAID command failed. Bye bye!");
-		return (1);
+		scrubRepaired += j - i;
+		logMessage(LOG_WARNING_LEVEL, "Scrubbing repaired %d blocks of disk %d from block %u.",
+			j - i, repairDisk, repairBlock + i);
 	}
 
-	// Recovers blocks by searching the allocation table for entries containing the
-	// failed disk
-	i = 0;
-	while (raidtable[i] != NULL) {
-		temp = (tableinfo *) raidtable[i];
-		if (temp->disk == diskFailed) {
-			// Reads from the cache if applicable
-			if ((cacheTemp = (int *) get_raid_cache(temp->disk, temp->blockID)) != NULL) {
-				hits++;
-				memcpy(failureBuf, cacheTemp, temp->contiguous * TAGLINE_BLOCK_SIZE);
-			}
-			
-			// Reads from RAID otherwise and inserts data into cache
-			else {
-				misses++;
-				response = create_raid_request(RAID_READ, temp->contiguous, 
-					temp->diskCopy, 0, 0, temp->blockIDCopy, failureBuf);
-				put_raid_cache(temp->diskCopy, temp->blockIDCopy, failureBuf);
-			}
-			responsetwo = create_raid_request(RAID_WRITE, temp->contiguous, 
-					temp->disk, 0, 0, temp->blockID, failureBuf);
-		}
-		else if (temp->diskCopy == diskFailed) {
-			// Reads from the cache if applicable
-			if ((cacheTemp = (int *) get_raid_cache(temp->diskCopy, temp->blockIDCopy)) != NULL) {
-				hits++;
-				memcpy(failureBuf, cacheTemp, temp->contiguous * TAGLINE_BLOCK_SIZE);
-			}
-			// Reads from RAID otherwise and inserts data into cache
-			else {
-				misses++;
-				response = create_raid_request(RAID_READ, temp->contiguous,
-					temp->disk, 0, 0, temp->blockID, failureBuf);
-				put_raid_cache(temp->diskCopy, temp->blockIDCopy, failureBuf);
-			}
-			responsetwo = create_raid_request(RAID_WRITE, temp->contiguous,
-				temp->diskCopy, 0, 0, temp->blockIDCopy, failureBuf);
-		}
+	return (0);
+}
 
-		// Checks if the RAID commands executed successfully if an allocation table entry is found
-		if (temp->disk == diskFailed || temp->diskCopy == diskFailed) {
-			extract_raid_response(response, arr, RAID_OPCODE_MAXVAL);
-			extract_raid_response(responsetwo, arrtwo, RAID_OPCODE_MAXVAL);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : repairFromCopy
+// Description  : Tells whether a block whose copies differ is repaired from
+//                its backup copy, which is only the case if checksums are on,
+//                the primary copy fails its checksum and the backup copy
+//                passes.
+//
+// Inputs       : entry - the extent of the block
+//                offset - the block within the extent
+//                primary - the block read from the primary copy
+//                copy - the block read from the backup copy
+// Outputs      : 1 to repair the primary copy from the backup copy, 0 to
+//                repair the backup copy from the primary copy
 
-			if (arr[RAID_OPCODE_STATUS] == 1 || arrtwo[RAID_OPCODE_STATUS] == 1) {
-				logMessage(LOG_ERROR_LEVEL, "A RAID command failed. Bye bye!");
-				return (1);
-			}
-		}
-		i++;
+int repairFromCopy (tableinfo *entry, int offset, const char *primary, const char *copy) {
+
+	// Declares local variables
+	char block[TAGLINE_BLOCK_SIZE];
+
+	if (!TAGLINE_CHECKSUM) {
+		return (0);
 	}
 
-	// Return successfully
-	logMessage(LOG_INFO_LEVEL, "TAGLINE processed raid disk signal successfully.");
+	// A packed block is checked as the tag block packed in it
+	if (entry->packed) {
+		if (decompressBlock(primary, entry->packed - 1, block) == 0 &&
+				verifyBlocks(entry->tagline, entry->taglineBlock + offset, 1, block) == 0) {
+			return (0);
+		}
+		return (decompressBlock(copy, entry->packed - 1, block) == 0 &&
+			verifyBlocks(entry->tagline, entry->taglineBlock + offset, 1, block) == 0);
+	}
 
-	return(0);
+	if (verifyBlocks(entry->tagline, entry->taglineBlock + offset, 1, primary) == 0) {
+		return (0);
+	}
+	return (verifyBlocks(entry->tagline, entry->taglineBlock + offset, 1, copy) == 0);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : create_raid_request
-// Description  : Constructs a request structure and makes a request.
-//		  
+// Function     : initChecksums
+// Description  : Builds the lookup table of the portable CRC32C and picks the
+//                SSE4.2 crc32 instruction instead if the processor has it
 //
-// Inputs       : requestType - value that indicates the request type
-//		  numBlocks - the number of blocks or number of tracks for RAID_INIT
-//		  diskNum - the disk number
-//		  unused - set to 0 for now
-//		  status - 0 for success or 1 for failure
-//		  blockID - the block ID
-//		  buf - buffer required by the bus request
-//		  
-// Outputs      : the response opcode
+// Inputs       : none
+// Outputs      : none
 
-RAIDOpCode create_raid_request (uint64_t requestType, uint64_t numBlocks, uint64_t diskNum,
-	uint64_t unused, uint64_t status, uint64_t blockID, void *buf){
-	
-	// Constructs the request structure
-	requestType = (requestType & STRCTURE_REQ) << (64 - NUMBER_REQ_BITS);
-	numBlocks = (numBlocks & STRUCTURE_BLOCK_NUM) << (64 - NUMBER_REQ_BITS - NUMBER_BLOCK_NUM_BITS);
-	diskNum = (diskNum & STRUCTURE_DISK_ID) << (64 - NUMBER_REQ_BITS - NUMBER_BLOCK_NUM_BITS - NUMBER_DISK_ID_BITS);
-	unused = (unused & STRUCTURE_UNUSED) << (64 - NUMBER_REQ_BITS - NUMBER_BLOCK_NUM_BITS - NUMBER_DISK_ID_BITS
-		- NUMBER_UNUSED_BITS);
-	status = (status & STRUCTURE_STATUS) << (64 - NUMBER_REQ_BITS - NUMBER_BLOCK_NUM_BITS - NUMBER_DISK_ID_BITS
-		- NUMBER_UNUSED_BITS - NUMBER_STATUS_BIT);
-	blockID = (blockID & STRUCTURE_BLOCK_ID);
-	
-	// Creates the opcode and makes a request
-	RAIDOpCode request = requestType|numBlocks|diskNum|unused|status|blockID;
-	return client_raid_bus_request(request, buf);
+void initChecksums (void) {
+
+	// Declares local variables
+	uint32_t crc;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++) {
+			crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		}
+		crc32cTable[i] = crc;
+	}
+
+	crc32c = crc32cPortable;
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("sse4.2")) {
+		crc32c = crc32cHardware;
+	}
+#endif
+	checksumFailures = 0;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : extract_raid_response
-// Description  : Extracts an opcode and stores the data in an array. 
+// Function     : crc32cPortable
+// Description  : Computes the CRC32C (Castagnoli) of a buffer a byte at a time
 //
-// Inputs       : resp -  the response opcode
-//		  arr - the array that will hold the values
-//		  arrLen - the length of the array (must be at least 6)
+// Inputs       : data - the buffer
+//                len - its length in bytes
+// Outputs      : the CRC32C
 
-void extract_raid_response (RAIDOpCode resp, int arr[], int arrLen){
+uint32_t crc32cPortable (const char *data, int len) {
 
-	// Ensures that the length of the array is long enough
-	if (arrLen < 6) {
-		return;
-	}
+	// Declares local variables
+	uint32_t crc = ~(uint32_t) 0;
+	int i;
 
-	// Extracts each field from the opcode and stores them in the array
-	arr[RAID_OPCODE_REQTYPE] = (resp >> (64 - NUMBER_REQ_BITS)) & STRCTURE_REQ;
-	arr[RAID_OPCODE_BLOCKS] = (resp >> (64 - NUMBER_REQ_BITS - NUMBER_BLOCK_NUM_BITS)) & STRUCTURE_BLOCK_NUM;
-	arr[RAID_OPCODE_DISKID] = (resp >> (64 - NUMBER_REQ_BITS - NUMBER_BLOCK_NUM_BITS - NUMBER_DISK_ID_BITS)) &
-		STRUCTURE_DISK_ID;
-	arr[RAID_OPCODE_UNUSED] = (resp >> (64 - NUMBER_REQ_BITS - NUMBER_BLOCK_NUM_BITS - NUMBER_DISK_ID_BITS
-		- NUMBER_UNUSED_BITS)) & STRUCTURE_UNUSED;
-	arr[RAID_OPCODE_STATUS] = (resp >> (64 - NUMBER_REQ_BITS - NUMBER_BLOCK_NUM_BITS - NUMBER_DISK_ID_BITS
-		- NUMBER_UNUSED_BITS - NUMBER_STATUS_BIT)) & STRUCTURE_STATUS;
-	arr[RAID_OPCODE_BLOCKID] = (resp) & STRUCTURE_BLOCK_ID;
+	for (i = 0; i < len; i++) {
+		crc = crc32cTable[(crc ^ (uint8_t) data[i]) & 0xff] ^ (crc >> 8);
+	}
 
-	return;
+	return (~crc);
 }
 
+#if defined(__x86_64__)
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : insertEntry
-// Description  : Creates a new entry with the given tagline info and opcodes, provided 
-// 		  that the tag number and block number combination does not already
-// 		  exist
-// Inputs       : tagNum - the tag number
-// 		  tagBlockNum - the starting block number
-// 		  blks - the number of blocks
-// 		  buf - the buffer
-// Outputs	: 0 for success, or -1 for failure
+// Function     : crc32cHardware
+// Description  : Computes the CRC32C of a buffer with the SSE4.2 crc32
+//                instruction, eight bytes at a time. Only called if the
+//                processor has SSE4.2.
+//
+// Inputs       : data - the buffer
+//                len - its length in bytes
+// Outputs      : the CRC32C
 
-int insertEntry (TagLineNumber tagNum, TagLineBlockNumber tagBlockNum, uint8_t blks, char* buf) {
+__attribute__((target("sse4.2")))
+uint32_t crc32cHardware (const char *data, int len) {
 
-	// Declares variables
-	RAIDDiskID newDisk, backupDisk;
-	RAIDBlockID newRAIDBlock, backupRAIDBlock;
-	RAIDOpCode response, responsetwo;
-	tableinfo *temp;
-	int entry, i;
-	int arr[RAID_OPCODE_MAXVAL] = {0};
-	int arrtwo[RAID_OPCODE_MAXVAL] = {0};
-	flag invalid;
+	// Declares local variables
+	uint64_t crc = ~(uint32_t) 0, word;
+	int i;
 
-	// Ensures that the tag number and block number combination does not already exist
-	if (getTagEntry(tagNum, tagBlockNum) != NULL) {
-		return (-1);
+	for (i = 0; i + 8 <= len; i += 8) {
+		memcpy(&word, &data[i], sizeof(word));
+		crc = _mm_crc32_u64(crc, word);
+	}
+	for (; i < len; i++) {
+		crc = _mm_crc32_u8((uint32_t) crc, (uint8_t) data[i]);
 	}
 
-	// Selects a contiguous range of blocks that are not already occupuied
-	// for the primary copy
-	newDisk = rand() % NUM_DISKS;
-	do {
-		invalid = FALSE;
-		newRAIDBlock = rand() % (MAX_TRACKS * RAID_TRACK_BLOCKS);
+	return (~(uint32_t) crc);
+}
+#endif
 
-		// Ensures that the range of blocks do not pass
-		// the end of the RAID disk
-		if (newRAIDBlock + blks >= MAX_TRACKS * RAID_TRACK_BLOCKS) {
-			invalid = TRUE;
-			continue;
-		}
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : checksumKnown
+// Description  : Tells whether the checksum of a tag block is known
+//
+// Inputs       : slot - the tag block's slot in the tag directory
+// Outputs      : 1 if the checksum is known, 0 otherwise
 
-		for (i = 0; i < blks; i++) {
-			if (getRAIDEntry(newDisk, newRAIDBlock + i) != NULL) {
-				invalid = TRUE;
-				break;
-			}
-		}
-	} while (invalid == TRUE);
+int checksumKnown (uint32_t slot) {
+	return ((checksumBitmap[slot / BITMAP_WORD_BITS] >> (slot % BITMAP_WORD_BITS)) & 1);
+}
 
-	// Writes into primary RAID designation and cache
-	response = create_raid_request
-		(RAID_WRITE, blks, newDisk, 0, 0, newRAIDBlock, buf);
-	if (get_raid_cache(newDisk, newRAIDBlock) == NULL) misses++; else hits++;
-	put_raid_cache(newDisk, newRAIDBlock, buf);
-
-	// Selects a contiguous range of blocks that are not already occupuied
-	// for the backup copy
-	do {
-		invalid = FALSE;
-		backupDisk = rand() % NUM_DISKS;
-		backupRAIDBlock = rand() % (MAX_TRACKS * RAID_TRACK_BLOCKS);
-
-		// Ensures that the range of blocks are not in the same disk and they do not pass
-		// the end of the RAID disk
-		if (backupDisk == newDisk || backupRAIDBlock + blks >= MAX_TRACKS * RAID_TRACK_BLOCKS) {
-			invalid = TRUE;
-			continue;
-		}
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : setChecksums
+// Description  : Records the checksums of a run of blocks of a tag as they are
+//                written, or forgets them. Blocks past the last possible tag
+//                block are ignored. Called with the tag's lock held.
+//
+// Inputs       : tag - the tag
+//                bnum - the first block
+//                blks - the number of blocks
+//                buf - the blocks written, or NULL to forget their checksums
+// Outputs      : none
 
-		for (i = 0; i < blks; i++) {
-			if (getRAIDEntry(backupDisk, backupRAIDBlock + i) != NULL) {
-				invalid = TRUE;
-				break;
-			}
-		}
-	} while (invalid == TRUE);
-		
-	// Writes into backup RAID designation and cache
-	responsetwo = create_raid_request
-		(RAID_WRITE, blks, backupDisk, 0, 0, backupRAIDBlock, buf);
-	if (get_raid_cache(backupDisk, backupRAIDBlock) == NULL) misses++; else hits++;
-	put_raid_cache(backupDisk, backupRAIDBlock, buf);
+void setChecksums (TagLineNumber tag, TagLineBlockNumber bnum, int blks, const char *buf) {
 
-	// Checks if the RAID commands executed successfully 
-	extract_raid_response(response, arr, RAID_OPCODE_MAXVAL);
-	extract_raid_response(responsetwo, arrtwo, RAID_OPCODE_MAXVAL);
+	// Declares local variables
+	uint32_t slot;
+	int i;
 
-	if (arr[RAID_OPCODE_STATUS] == 1 || arrtwo[RAID_OPCODE_STATUS] == 1) {
-		logMessage(LOG_ERROR_LEVEL, "A RAID command failed.");
-		return (-1);
+	if (!TAGLINE_CHECKSUM) {
+		return;
 	}
-	
-	for (i = 0; i < blks; i++) {
-		// Allocates memory for a new entry
-		temp = (tableinfo *) calloc(1, sizeof(tableinfo));
 
-		if (!temp) {
-			logMessage(LOG_ERROR_LEVEL, "Memory allocation failed.");
-			return (-1);
+	for (i = 0; i < blks && bnum + i < MAX_TAGLINE_BLOCK_NUMBER; i++) {
+		slot = (tag * MAX_TAGLINE_BLOCK_NUMBER) + bnum + i;
+		if (buf != NULL) {
+			blockChecksums[slot] = crc32c(&buf[i * TAGLINE_BLOCK_SIZE], TAGLINE_BLOCK_SIZE);
+			checksumBitmap[slot / BITMAP_WORD_BITS] |= ((uint64_t) 1 << (slot % BITMAP_WORD_BITS));
+		}
+		else {
+			checksumBitmap[slot / BITMAP_WORD_BITS] &= ~((uint64_t) 1 << (slot % BITMAP_WORD_BITS));
 		}
-
-		// Enters data into the entry
-		temp->tagline = tagNum;
-		temp->taglineBlock = tagBlockNum + i;
-		temp->contiguous = (int) blks;
-		temp->disk = arr[RAID_OPCODE_DISKID];
-		temp->blockID = arr[RAID_OPCODE_BLOCKID] + i;
-		temp->diskCopy = arrtwo[RAID_OPCODE_DISKID]; 
-		temp->blockIDCopy = arrtwo[RAID_OPCODE_BLOCKID] + i;
-
-		// Finds the offset for the new entry
-		entry = 0;
-		while (raidtable[entry] != NULL) entry++;
-
-		// Adds the entry to the allocation table
-		raidtable[entry] = temp;
 	}
-
-	return 0;
 }
 
-
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : getTagEntry
-// Description  : Extracts the address of the entry with the tagline number and 
-// 		  tagline block number combination in the table, if it exists 
+// Function     : verifyBlocks
+// Description  : Checks a run of blocks of a tag against their checksums,
+//                counting the blocks that fail. A block whose checksum is not
+//                known (written before a restart that was not a clean close)
+//                passes. Called with the tag's lock held.
 //
-// Inputs       : tagNum - the tagline number to examine
-//		  tagBlockNum - the tagline block number to examine 
-// Outputs	: the pointer to the entry, or NULL if it does not exist
+// Inputs       : tag - the tag
+//                bnum - the first block
+//                blks - the number of blocks
+//                buf - the blocks
+// Outputs      : 0 if every block passes, -1 otherwise
 
-void* getTagEntry (TagLineNumber tagNum, TagLineBlockNumber tagBlockNum){
+int verifyBlocks (TagLineNumber tag, TagLineBlockNumber bnum, int blks, const char *buf) {
 
 	// Declares local variables
-	int entry = 0;
-	tableinfo *temp; 
-		
-	// Searches the allocation table while the current entry exists
-	// Returns the address of the entry with matching tag number
-	// and tag block number if entry is found
-	while (raidtable[entry] != NULL) {
-		temp = (tableinfo *) raidtable[entry];
-		if (temp->tagline == tagNum && temp->taglineBlock == tagBlockNum) return temp;
-		entry++;
+	uint32_t slot;
+	int i, result = 0;
+
+	for (i = 0; i < blks; i++) {
+		slot = (tag * MAX_TAGLINE_BLOCK_NUMBER) + bnum + i;
+		if (checksumKnown(slot) &&
+				crc32c(&buf[i * TAGLINE_BLOCK_SIZE], TAGLINE_BLOCK_SIZE) != blockChecksums[slot]) {
+			checksumFailures++;
+			result = -1;
+		}
 	}
 
-	// Returns NULL if entry is not found
-	return NULL;
+	return (result);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : getRAIDEntry
-// Description  : Extracts the address of the entry with the RAID disk number and block
-// 		  ID combination, if it exists
+// Function     : failoverRead
+// Description  : Reads a block of an extent that failed its checksum again,
+//                from each copy in turn other than the one it was read from,
+//                until one passes. A packed block is decompressed before it is
+//                checked. Called with the tag's lock held and the rebuild lock
+//                held for reading.
 //
-// Inputs       : diskNum - the tagline number to examine
-//		  blockIDNum - the tagline block number to examine 
-// Outputs	: the pointer to the entry, or NULL if it does not exist
+// Inputs       : entry - the extent of the block
+//                offset - the block within the extent
+//                badDisk - the disk the block was read from, or NUM_DISKS if
+//                          it came from the cache
+//                raw - memory for the block read from RAID
+//                block - memory for the tag block (the same as raw unless the
+//                        block is packed)
+// Outputs      : 0 if a copy passes, -1 otherwise
 
-void* getRAIDEntry (RAIDDiskID diskNum, RAIDBlockID blockIDNum){
+int failoverRead (tableinfo *entry, int offset, RAIDDiskID badDisk, char *raw, char *block) {
 
 	// Declares local variables
-	uint64_t entry = 0;
-	tableinfo *temp; 
+	RAIDOpCode response;
+	RAIDDiskID disks[2] = { entry->disk, entry->diskCopy };
+	RAIDBlockID blocks[2] = { entry->blockID + offset, entry->blockIDCopy + offset };
+	int arr[RAID_OPCODE_MAXVAL] = {0};
+	int i;
 
-	// Searches the allocation table for a RAID disk number and block ID combination
-	while (raidtable[entry] != NULL) {
-		temp = (tableinfo *) raidtable[entry];
-		if (temp->disk == diskNum && temp->blockID == blockIDNum) return temp;
-		if (temp->diskCopy == diskNum && temp->blockIDCopy == blockIDNum) return temp;
-		entry++;
-	}
+	for (i = 0; i < 2; i++) {
+		if (disks[i] == badDisk || !usableCopy(disks[i], blocks[i], 1)) {
+			continue;
+		}
+
+		response = create_raid_request(RAID_READ, 1, disks[i], 0, 0, blocks[i], raw);
+		extract_raid_response(response, arr, RAID_OPCODE_MAXVAL);
+		if (arr[RAID_OPCODE_STATUS] == 1) {
+			continue;
+		}
+		if (entry->packed && decompressBlock(raw, entry->packed - 1, block) == -1) {
+			checksumFailures++;
+			continue;
+		}
 
+		if (verifyBlocks(entry->tagline, entry->taglineBlock + offset, 1, block) == 0) {
+			logMessage(LOG_WARNING_LEVEL, "Block %u of tagline %u failed its checksum; read it from disk %d.",
+				entry->taglineBlock + offset, entry->tagline, disks[i]);
+			return (0);
+		}
+	}
 
-	// Returns NULL
-	return NULL;
+	logMessage(LOG_ERROR_LEVEL, "No copy of block %u of tagline %u passes its checksum. Bye bye!",
+		entry->taglineBlock + offset, entry->tagline);
+	return (-1);
 }
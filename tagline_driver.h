@@ -19,10 +19,36 @@
 #define TAGLINE_BLOCK_SIZE        RAID_BLOCK_SIZE
 #define RAID_DISKS                9
 #define RAID_DISKBLOCKS           4096
+#define TAGLINE_CACHE_WRITE_BACK  0     // 1 holds written blocks dirty in the cache
+#define TAGLINE_DEDUP             0     // 1 stores blocks with identical contents once
+#define TAGLINE_COMPRESS          0     // 1 packs blocks that compress well several to a block
+#define TAGLINE_SCRUB_RATE        0     // blocks a second the mirror scrubber verifies (0 for none)
+#define TAGLINE_CHECKSUM          0     // 1 verifies a CRC32C of every block read from RAID
+#define TAGLINE_JOURNAL_FILE      "tagline.journal" // block map journal kept for warm restarts
 
 // Type definitions
 typedef uint16_t TagLineNumber;
 typedef uint32_t TagLineBlockNumber;
+typedef int32_t TagLineRequest;
+
+// Called by a driver thread when a submitted request finishes, with the status
+// tagline_read/tagline_write would have returned
+typedef void (*TagLineCallback)(TagLineRequest request, int status, void *arg);
+
+// One request of a vectored read or write
+typedef struct {
+	TagLineNumber tag;
+	TagLineBlockNumber bnum;
+	uint8_t blks;
+	char *buf;
+} TagLineVector;
+
+// A finished request that was submitted without a callback
+typedef struct {
+	TagLineRequest request;
+	int status;
+	void *arg;
+} TagLineCompletion;
 
 //
 // Interface functions
@@ -30,12 +56,45 @@ typedef uint32_t TagLineBlockNumber;
 int tagline_driver_init(uint32_t maxlines);
 	// Initialize the driver with a number of maximum lines to process
 
+int tagline_driver_restart(uint32_t maxlines);
+	// Initialize the driver from the journal of the previous run without formatting
+
 int tagline_read(TagLineNumber tag, TagLineBlockNumber bnum, uint8_t blks, char *buf);
 	// Read a number of blocks from the tagline driver
 
 int tagline_write(TagLineNumber tag, TagLineBlockNumber bnum, uint8_t blks, char *buf);
 	// Write a number of blocks from the tagline driver
 
+int tagline_read_pinned(TagLineNumber tag, TagLineBlockNumber bnum, uint8_t blks,
+	const char *blocks[]);
+	// Read a number of blocks in place in the cache, pinned until released
+
+void tagline_release(const char *blocks[], uint8_t blks);
+	// Release blocks returned by tagline_read_pinned
+
+int tagline_readv(TagLineVector *vec, int count);
+	// Read several ranges of blocks, possibly of different taglines, as one batch
+
+int tagline_writev(TagLineVector *vec, int count);
+	// Write several ranges of blocks, possibly of different taglines, as one batch
+
+TagLineRequest tagline_submit_read(TagLineNumber tag, TagLineBlockNumber bnum, uint8_t blks,
+	char *buf, TagLineCallback done, void *arg);
+	// Queue a read and return its handle at once (-1 if the queue is full)
+
+TagLineRequest tagline_submit_write(TagLineNumber tag, TagLineBlockNumber bnum, uint8_t blks,
+	char *buf, TagLineCallback done, void *arg);
+	// Queue a write and return its handle at once (-1 if the queue is full)
+
+int tagline_reap(TagLineCompletion *done, int max, int wait);
+	// Collect finished requests that had no callback, waiting for one if asked
+
+int tagline_delete(TagLineNumber tag);
+	// Delete a tagline, freeing its blocks
+
+int tagline_truncate(TagLineNumber tag, TagLineBlockNumber nblocks);
+	// Shorten a tagline to a number of blocks, freeing the rest
+
 int tagline_close(void);
 	// Close the tagline interface
 
@@ -54,11 +113,11 @@ int insertEntry (TagLineNumber tagNum, TagLineBlockNumber tagBlockNum, uint8_t b
 	// number and block number combination does not already exist
 
 void* getTagEntry (TagLineNumber tagNum, TagLineBlockNumber tagBlockNum);
-	// Extracts the address of the entry with the tagline number and tagline
-	// block number combination, if it exists
+	// Extracts the address of the extent holding the tagline number and
+	// tagline block number combination, if it exists
 
 void* getRAIDEntry (RAIDDiskID diskNum, RAIDBlockID blockIDNum);
-	// Extracts the address of the entry with the RAID disk number and block ID
-	// combination, if it exists
+	// Extracts the address of the extent holding the RAID disk number and
+	// block ID combination, if it exists
 
 #endif /* RAID_DRIVER_INCLUDED */